@@ -6,6 +6,9 @@
 #include "user_service.hpp"
 #include "../globals.hpp"
 #include "../../common/static/service.hpp"
+#include "../../common/fiber/future_combinators.hpp"
+#include "../../common/data/msgpack.hpp"
+#include "../../common/text/display_width.hpp"
 #include <poseidon/base/config_file.hpp>
 #include <poseidon/easy/easy_hws_server.hpp>
 #include <poseidon/easy/easy_timer.hpp>
@@ -16,10 +19,57 @@
 #include <poseidon/fiber/mysql_query_future.hpp>
 #include <poseidon/mysql/mysql_connection.hpp>
 #include <poseidon/static/mysql_connector.hpp>
+#define OPENSSL_API_COMPAT  0x10100000L
+#include <openssl/md5.h>
+#include <deque>
+#include <algorithm>
 namespace k32::agent {
 namespace {
 
 const cow_dictionary<User_Record> empty_user_map;
+constexpr milliseconds login_latency_bounds[] = { 50ms, 100ms, 200ms, 500ms, 1s, 2s, 5s };
+constexpr seconds check_user_interval = 5s;
+constexpr size_t check_user_ticks_per_cycle = 24;  // two minutes
+constexpr seconds ping_wheel_tick = 1s;
+constexpr seconds client_rate_window = 5s;
+constexpr seconds logout_flush_interval = 2s;
+constexpr size_t logout_flush_batch_size = 500;
+constexpr size_t max_pending_logouts = 20000;
+constexpr size_t max_http_cache_entries = 10000;
+
+struct HTTP_Cache_Entry
+  {
+    cow_string content_type;
+    cow_string payload;
+    cow_string etag;
+    steady_time expiry_time;
+  };
+
+struct Ping_Wheel_Entry
+  {
+    phcow_string username;
+    wkptr<::poseidon::WS_Server_Session> weak_session;
+  };
+
+enum Relay_Shard : uint8_t
+  {
+    relay_shard_roid      = 0,  // consistent hashing of role ID
+    relay_shard_username  = 1,  // consistent hashing of username
+    relay_shard_load      = 2,  // lowest load factor
+  };
+
+struct Relay_Route
+  {
+    cow_string service_type;
+    Relay_Shard shard = relay_shard_roid;
+  };
+
+struct Cached_Avatar
+  {
+    // These are empty for a fresh role.
+    cow_string json;
+    cow_string msgpack;
+  };
 
 struct User_Connection
   {
@@ -27,10 +77,42 @@ struct User_Connection
     steady_time rate_time;
     steady_time pong_time;
     int rate_counter = 0;
+    bool binary_encoding = false;
 
     int64_t current_roid = 0;
     ::poseidon::UUID current_logic_srv;
-    cow_int64_dictionary<::taxon::V_object> cached_raw_avatars;
+    cow_int64_dictionary<Cached_Avatar> cached_avatars;
+    cow_string role_list_json;
+    cow_string role_list_msgpack;
+    cow_vector<phcow_string> channels;
+  };
+
+struct Login_Ticket final : ::poseidon::Abstract_Future
+  {
+    wkptr<::poseidon::WS_Server_Session> weak_session;
+    bool binary_encoding = false;
+    steady_time enqueue_time;
+    bool admitted = false;
+
+    virtual
+    void
+    do_on_abstract_future_initialize() override
+      {
+      }
+
+    void
+    complete(bool admit)
+      {
+        this->admitted = admit;
+        this->do_abstract_future_initialize_once();
+      }
+  };
+
+struct Nickname_Change
+  {
+    phcow_string nickname;
+    phcow_string username;  // owner; ignored if released
+    bool released;
   };
 
 struct Implementation
@@ -41,13 +123,21 @@ struct Implementation
     uint16_t max_number_of_roles_per_user = 0;
     uint8_t nickname_length_limits[2] = { };
     seconds client_ping_interval;
+    uint16_t max_concurrent_logins;
 
     cow_dictionary<User_Service::http_handler_type> http_handlers;
+    cow_dictionary<seconds> http_cache_ttls;
     cow_dictionary<User_Service::ws_authenticator_type> ws_authenticators;
     cow_dictionary<User_Service::ws_handler_type> ws_handlers;
+    cow_dictionary<bool> opaque_relay_opcodes;
+    cow_dictionary<Relay_Route> relay_routes;
 
     ::poseidon::Easy_Timer ping_timer;
+    ::poseidon::Easy_Timer ping_wheel_timer;
     ::poseidon::Easy_Timer check_user_timer;
+    ::poseidon::Easy_Timer login_queue_timer;
+    ::poseidon::Easy_Timer logout_flush_timer;
+    ::poseidon::Easy_Timer nickname_sync_timer;
     ::poseidon::Easy_HWS_Server user_server;
 
     // connections from clients
@@ -55,6 +145,40 @@ struct Implementation
     cow_dictionary<User_Record> users;
     cow_dictionary<User_Connection> connections;
     ::std::vector<phcow_string> expired_username_list;
+
+    // Connections are spread over slots of a timer wheel, which are visited in
+    // turn, one per tick, so each connection is checked once per ping interval
+    // and pings are not sent in bursts.
+    ::std::vector<::std::vector<Ping_Wheel_Entry>> ping_wheel;
+    size_t ping_wheel_cursor = 0;
+    uint32_t login_latency_counts[::std::size(login_latency_bounds) + 1] = { };
+    ::std::vector<phcow_string> refresh_username_list;
+    size_t refresh_count_per_tick = 0;
+
+    // admission of logins; a login slot is required before accessing databases
+    uint32_t logins_in_progress = 0;
+    ::std::deque<shptr<Login_Ticket>> login_queue;
+    uint32_t login_admitted_count = 0;
+    steady_clock::duration login_wait_total = steady_clock::duration::zero();
+    steady_clock::duration login_wait_max = steady_clock::duration::zero();
+
+    // nicknames that are known to have been taken, mapped to their owners
+    cow_dictionary<phcow_string> nickname_index;
+    int64_t nickname_index_serial = 0;
+    steady_time nickname_index_rebuild_time;
+    bool nickname_sync_running = false;
+    bool nickname_index_rebuilding = false;
+    ::std::vector<Nickname_Change> nickname_changes;  // made during a rebuild
+
+    // logout times that have not been written to MySQL; as there is no stop
+    // path, those that are still pending when the process exits are lost
+    cow_dictionary<system_time> pending_logout_times;
+
+    // cached HTTP responses; keys are paths and query strings
+    cow_dictionary<HTTP_Cache_Entry> http_cache;
+
+    // channels for broadcasting; each channel maps usernames to sessions
+    cow_dictionary<cow_dictionary<wkptr<::poseidon::WS_Server_Session>>> channels;
   };
 
 phcow_string
@@ -73,6 +197,133 @@ do_get_username(const shptr<Implementation>& impl, const shptr<::poseidon::WS_Se
     return it->first;
   }
 
+void
+do_add_to_ping_wheel(const shptr<Implementation>& impl, const phcow_string& username,
+                     const shptr<::poseidon::WS_Server_Session>& session)
+  {
+    // Put the connection into the slot that was visited last, which will be
+    // visited again after a full cycle.
+    ROCKET_ASSERT(!impl->ping_wheel.empty());
+    size_t slot = (impl->ping_wheel_cursor + impl->ping_wheel.size() - 1) % impl->ping_wheel.size();
+    auto& entry = impl->ping_wheel.at(slot).emplace_back();
+    entry.username = username;
+    entry.weak_session = session;
+  }
+
+void
+do_resize_ping_wheel(const shptr<Implementation>& impl, size_t count)
+  {
+    if(impl->ping_wheel.size() == count)
+      return;
+
+    // Redistribute connections evenly.
+    ::std::vector<::std::vector<Ping_Wheel_Entry>> old_wheel;
+    old_wheel.swap(impl->ping_wheel);
+    impl->ping_wheel.resize(count);
+    impl->ping_wheel_cursor = 0;
+
+    size_t slot = 0;
+    for(auto& old_slot : old_wheel)
+      for(auto& entry : old_slot) {
+        impl->ping_wheel.at(slot).emplace_back(move(entry));
+        slot = (slot + 1) % count;
+      }
+  }
+
+struct Client_Message
+  {
+    ::taxon::Value value;
+    tinybuf_ln json_buf;
+    cow_string msgpack_buf;
+  };
+
+bool
+do_send_client_message(const shptr<::poseidon::WS_Server_Session>& session, bool binary_encoding,
+                       Client_Message& msg)
+  {
+    // A message may be sent to many clients, so encode it at most once per
+    // encoding.
+    if(binary_encoding) {
+      if(msg.msgpack_buf.empty())
+        msgpack_encode(msg.msgpack_buf, msg.value);
+      return session->ws_send(::poseidon::ws_BINARY,
+                              ::poseidon::chars_view(msg.msgpack_buf.data(), msg.msgpack_buf.size()));
+    }
+    else {
+      if(msg.json_buf.size() == 0)
+        msg.value.print_to(msg.json_buf, ::taxon::option_json_mode);
+      return session->ws_send(::poseidon::ws_TEXT, msg.json_buf);
+    }
+  }
+
+void
+do_set_cached_avatar(User_Connection& uconn, int64_t roid, const cow_string& raw_avatar)
+  {
+    // For intermediate servers, an avatar is transferred as a string. Convert
+    // it for clients here, only once. Mind a fresh role (that has just been
+    // created but has not been loaded yet), whose avatar is an empty string.
+    Cached_Avatar avatar;
+    if(!raw_avatar.empty()) {
+      ::taxon::Value temp_value;
+      POSEIDON_CHECK(temp_value.parse(raw_avatar));
+
+      ::rocket::tinybuf_str buf;
+      temp_value.print_to(buf, ::taxon::option_json_mode);
+      avatar.json = buf.get_string();
+      msgpack_encode(avatar.msgpack, temp_value);
+    }
+
+    uconn.cached_avatars.insert_or_assign(roid, avatar);
+
+    // Invalidate the role list. It will be assembled again when it's sent.
+    uconn.role_list_json.clear();
+    uconn.role_list_msgpack.clear();
+  }
+
+void
+do_send_role_list(const shptr<::poseidon::WS_Server_Session>& session, User_Connection& uconn)
+  {
+    // The role list is assembled from converted avatars without parsing or
+    // printing anything, and is kept until an avatar changes.
+    if(uconn.binary_encoding) {
+      if(uconn.role_list_msgpack.empty()) {
+        cow_string& out = uconn.role_list_msgpack;
+        msgpack_encode_map_header(out, 2);
+        msgpack_encode(out, cow_string(&"%opcode"));
+        msgpack_encode(out, cow_string(&"=role/list"));
+        msgpack_encode(out, cow_string(&"avatar_list"));
+        msgpack_encode_array_header(out, uconn.cached_avatars.size());
+        for(const auto& r : uconn.cached_avatars)
+          if(r.second.msgpack.empty())
+            msgpack_encode_map_header(out, 0);
+          else
+            out += r.second.msgpack;
+      }
+
+      session->ws_send(::poseidon::ws_BINARY,
+                       ::poseidon::chars_view(uconn.role_list_msgpack.data(), uconn.role_list_msgpack.size()));
+    }
+    else {
+      if(uconn.role_list_json.empty()) {
+        cow_string& out = uconn.role_list_json;
+        out = &R"({"%opcode":"=role/list","avatar_list":[)";
+        for(const auto& r : uconn.cached_avatars) {
+          if(out.back() != '[')
+            out += ',';
+
+          if(r.second.json.empty())
+            out += "{}";
+          else
+            out += r.second.json;
+        }
+        out += "]}";
+      }
+
+      session->ws_send(::poseidon::ws_TEXT,
+                       ::poseidon::chars_view(uconn.role_list_json.data(), uconn.role_list_json.size()));
+    }
+  }
+
 ::poseidon::UUID
 do_find_my_monitor()
   {
@@ -87,6 +338,94 @@ do_find_my_monitor()
     return monitor_service_uuid;
   }
 
+void
+do_leave_all_channels(const shptr<Implementation>& impl, const phcow_string& username,
+                      const User_Connection& uconn)
+  {
+    for(const auto& channel : uconn.channels)
+      if(auto members = impl->channels.mut_ptr(channel)) {
+        members->erase(username);
+        if(members->empty())
+          impl->channels.erase(channel);
+      }
+  }
+
+void
+do_record_login_latency(const shptr<Implementation>& impl, steady_clock::duration latency)
+  {
+    size_t k = 0;
+    while((k != ::std::size(login_latency_bounds)) && (latency >= login_latency_bounds[k]))
+      k ++;
+
+    impl->login_latency_counts[k] ++;
+  }
+
+void
+do_record_login_wait(const shptr<Implementation>& impl, steady_clock::duration wait)
+  {
+    impl->login_admitted_count ++;
+    impl->login_wait_total += wait;
+    impl->login_wait_max = ::std::max(impl->login_wait_max, wait);
+  }
+
+bool
+do_acquire_login_slot(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
+                      const shptr<::poseidon::WS_Server_Session>& session, bool binary_encoding)
+  {
+    if(impl->login_queue.empty() && (impl->logins_in_progress < impl->max_concurrent_logins)) {
+      impl->logins_in_progress ++;
+      do_record_login_wait(impl, steady_clock::duration::zero());
+      return true;
+    }
+
+    // Wait for a slot to be passed to me. If the client disconnects while
+    // waiting, the ticket will be cancelled.
+    auto ticket = new_sh<Login_Ticket>();
+    ticket->weak_session = session;
+    ticket->binary_encoding = binary_encoding;
+    ticket->enqueue_time = steady_clock::now();
+    impl->login_queue.push_back(ticket);
+
+    POSEIDON_LOG_DEBUG(("Login queued: position $1"), impl->login_queue.size());
+    fiber.yield(ticket);
+    return ticket->admitted;
+  }
+
+void
+do_release_login_slot(const shptr<Implementation>& impl)
+  {
+    if(impl->login_queue.empty()) {
+      impl->logins_in_progress --;
+      return;
+    }
+
+    // Pass my slot to the first client in the queue.
+    auto ticket = move(impl->login_queue.front());
+    impl->login_queue.pop_front();
+    do_record_login_wait(impl, steady_clock::now() - ticket->enqueue_time);
+    ticket->complete(true);
+  }
+
+struct Login_Slot_Guard
+  {
+    shptr<Implementation> impl;
+
+    explicit
+    Login_Slot_Guard(const shptr<Implementation>& xi)
+      :
+        impl(xi)
+      {
+      }
+
+    Login_Slot_Guard(const Login_Slot_Guard&) = delete;
+    Login_Slot_Guard& operator=(const Login_Slot_Guard&) & = delete;
+
+    ~Login_Slot_Guard()
+      {
+        do_release_login_slot(this->impl);
+      }
+  };
+
 void
 do_publish_user_on_redis(::poseidon::Abstract_Fiber& fiber, const User_Record& uinfo, seconds ttl)
   {
@@ -138,6 +477,10 @@ do_role_logout_common(const shptr<Implementation>& impl, ::poseidon::Abstract_Fi
     service.launch(srv_q);
     fiber.yield(srv_q);
 
+    // The avatar may have been changed, so update it.
+    if(auto ptr = srv_q->response(0).obj.ptr(&"raw_avatar"))
+      do_set_cached_avatar(impl->connections.mut(username), roid, ptr->as_string());
+
     // Unlock the connection.
     impl->connections.mut(username).current_roid = 0;
     impl->connections.mut(username).current_logic_srv = ::poseidon::UUID();
@@ -188,29 +531,46 @@ do_welcome_client(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber&
     if(impl->connections.at(username).current_roid != 0)
       return;
 
-    if(impl->connections.at(username).cached_raw_avatars.size() > 0) {
-      // In case there's an online role, try reconnecting.
+    if(impl->connections.at(username).cached_avatars.size() > 0) {
+      // In case there's an online role, try reconnecting. Logic servers
+      // publish locations of their roles in Redis, so only those that may have
+      // an online role are asked.
       ::taxon::V_object tx_args;
       tx_args.try_emplace(&"agent_srv", service.service_uuid().to_string());
-      for(const auto& r : impl->connections.at(username).cached_raw_avatars)
+      cow_vector<cow_string> redis_cmd;
+      redis_cmd.emplace_back(&"MGET");
+      for(const auto& r : impl->connections.at(username).cached_avatars) {
         tx_args.open(&"roid_list").open_array().emplace_back(r.first);
+        redis_cmd.emplace_back(sformat("$1/role_logic/$2", service.application_name(), r.first));
+      }
+
+      auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
+      ::poseidon::task_scheduler.launch(task2);
+      fiber.yield(task2);
 
       cow_vector<::poseidon::UUID> multicast_list;
-      for(const auto& r : service.all_service_records())
-        if(r.second.service_type == "logic")
-          multicast_list.emplace_back(r.first);
+      for(const auto& r : task2->result().as_array())
+        if(r.is_string()) {
+          ::poseidon::UUID logic_service_uuid(r.as_string());
+          if(service.find_service_record_opt(logic_service_uuid)
+              && (::std::find(multicast_list.begin(), multicast_list.end(), logic_service_uuid)
+                  == multicast_list.end()))
+            multicast_list.emplace_back(logic_service_uuid);
+        }
 
-      auto srv_q = new_sh<Service_Future>(multicast_list, &"*role/reconnect", tx_args);
-      service.launch(srv_q);
-      fiber.yield(srv_q);
+      if(!multicast_list.empty()) {
+        auto srv_q = new_sh<Service_Future>(multicast_list, &"*role/reconnect", tx_args);
+        service.launch(srv_q);
+        fiber.yield(srv_q);
 
-      for(const auto& resp : srv_q->responses()) {
-        auto ptr = resp.obj.ptr(&"status");
-        if(ptr && ptr->is_string() && (ptr->as_string() == "gs_ok")) {
-          // Use the online role.
-          impl->connections.mut(username).current_roid = resp.obj.at(&"roid").as_integer();
-          impl->connections.mut(username).current_logic_srv = resp.service_uuid;
-          break;
+        for(const auto& resp : srv_q->responses()) {
+          auto ptr = resp.obj.ptr(&"status");
+          if(ptr && ptr->is_string() && (ptr->as_string() == "gs_ok")) {
+            // Use the online role.
+            impl->connections.mut(username).current_roid = resp.obj.at(&"roid").as_integer();
+            impl->connections.mut(username).current_logic_srv = resp.service_uuid;
+            break;
+          }
         }
       }
     }
@@ -220,8 +580,8 @@ do_welcome_client(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber&
 
     // No role is online. If a fresh role exists, resume creation.
     int64_t fresh_roid = 0;
-    for(const auto& r : impl->connections.at(username).cached_raw_avatars)
-      if(r.second.empty())
+    for(const auto& r : impl->connections.at(username).cached_avatars)
+      if(r.second.json.empty())
         fresh_roid = r.first;
 
     if(fresh_roid != 0) {
@@ -241,17 +601,163 @@ do_welcome_client(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber&
 
     // No role is online. No role is being created. Send my role list to the
     // client, so the user may select an existing role, or create a new one.
-    ::taxon::V_array avatar_list;
-    for(const auto& r : impl->connections.at(username).cached_raw_avatars)
-      avatar_list.emplace_back(r.second);
+    do_send_role_list(session, impl->connections.mut(username));
+  }
+
+void
+do_make_logout_batch(const shptr<Implementation>& impl, cow_string& stmt,
+                     cow_vector<::poseidon::MySQL_Value>& sql_args,
+                     cow_dictionary<system_time>& batch, size_t limit)
+  {
+    // Take some users away, and compose a single statement for all of them:
+    //   UPDATE `user`
+    //     SET `logout_time` = CASE `username` WHEN ? THEN ? ... END
+    //     WHERE `username` IN (?, ...)
+    batch.clear();
+    for(const auto& r : impl->pending_logout_times)
+      if(batch.size() < limit)
+        batch.insert_or_assign(r.first, r.second);
+
+    stmt = &"UPDATE `user` SET `logout_time` = CASE `username`";
+    sql_args.clear();
+    for(const auto& r : batch) {
+      stmt += " WHEN ? THEN ?";
+      sql_args.emplace_back(r.first.rdstr());
+      sql_args.emplace_back(r.second);
+    }
+
+    stmt += " END WHERE `username` IN (";
+    for(const auto& r : batch) {
+      stmt += "?,";
+      sql_args.emplace_back(r.first.rdstr());
+      impl->pending_logout_times.erase(r.first);
+    }
+
+    stmt.mut_back() = ')';
+  }
+
+void
+do_restore_logout_batch(const shptr<Implementation>& impl, const cow_dictionary<system_time>& batch)
+  {
+    // Put logout times back after a failed write, unless a user has logged out
+    // again in the meantime, whose time is newer.
+    for(const auto& r : batch)
+      impl->pending_logout_times.try_emplace(r.first, r.second);
+  }
+
+void
+do_flush_logout_times(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
+                      size_t max_batches)
+  {
+    cow_string stmt;
+    cow_vector<::poseidon::MySQL_Value> sql_args;
+    cow_dictionary<system_time> batch;
+    while((max_batches != 0) && !impl->pending_logout_times.empty()) {
+      max_batches --;
+      do_make_logout_batch(impl, stmt, sql_args, batch, logout_flush_batch_size);
+
+      try {
+        auto task = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
+                                    ::poseidon::mysql_connector.allocate_tertiary_connection(),
+                                    stmt, sql_args);
+        ::poseidon::task_scheduler.launch(task);
+        fiber.yield(task);
+
+        // If the statement has failed, this throws an exception. Log statements
+        // may not evaluate their arguments, so this is done outside.
+        auto matched = task->match_count();
+        POSEIDON_LOG_DEBUG(("Wrote logout times of $1 users: $2 row(s) matched"),
+                           batch.size(), matched);
+      }
+      catch(exception& stdex) {
+        do_restore_logout_batch(impl, batch);
+        throw;
+      }
+    }
+  }
+
+void
+do_logout_flush_timer_callback(const shptr<Implementation>& impl,
+                               const shptr<::poseidon::Abstract_Timer>& /*timer*/,
+                               ::poseidon::Abstract_Fiber& fiber, steady_time /*now*/)
+  {
+    // Write a few batches at a time, so a backlog is drained gradually.
+    do_flush_logout_times(impl, fiber, 4);
+  }
 
+void
+do_relay_pass_to_logic(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
+                       const phcow_string& username, ::taxon::V_object& response,
+                       cow_string& raw_response, const phcow_string& opcode,
+                       bool binary_encoding, const ::taxon::V_binary& raw_request)
+  {
+    ::poseidon::UUID logic_service_uuid = impl->connections.at(username).current_logic_srv;
+    if(logic_service_uuid.is_nil()) {
+      response.try_emplace(&"status", &"sc_no_role_selected");
+      return;
+    }
+
+    // Only a small routing header is added, so the request needn't be printed
+    // again, and the response needn't be parsed or printed here.
     ::taxon::V_object tx_args;
-    tx_args.try_emplace(&"%opcode", &"=role/list");
-    tx_args.try_emplace(&"avatar_list", avatar_list);
+    tx_args.try_emplace(&"roid", impl->connections.at(username).current_roid);
+    tx_args.try_emplace(&"client_opcode", opcode.rdstr());
+    tx_args.try_emplace(&"client_msgpack", binary_encoding);
+    tx_args.try_emplace(&"client_data", raw_request);
 
-    tinybuf_ln buf;
-    ::taxon::Value(tx_args).print_to(buf, ::taxon::option_json_mode);
-    session->ws_send(::poseidon::ws_TEXT, buf);
+    auto srv_q = new_sh<Service_Future>(logic_service_uuid, &"*role/on_client_request", tx_args);
+    service.launch(srv_q);
+    fiber.yield(srv_q);
+
+    if(srv_q->response(0).error != "")
+      POSEIDON_THROW(("Could not forward client request: $1"), srv_q->response(0).error);
+
+    if(auto ptr = srv_q->response(0).obj.ptr(&"client_resp_data")) {
+      const auto& bin = ptr->as_binary();
+      raw_response.assign(reinterpret_cast<const char*>(bin.data()), bin.size());
+    }
+  }
+
+void
+do_evict_http_cache(const shptr<Implementation>& impl)
+  {
+    // Query strings come from clients, so the number of cached responses must
+    // be bounded. Expired responses go first. If there are not enough, those
+    // that expire soonest are evicted, so there's room for an eighth of the
+    // limit, and the scan is amortized over that many insertions.
+    steady_time now = steady_clock::now();
+    ::std::vector<::std::pair<steady_time, phcow_string>> victims;
+    for(auto it = impl->http_cache.mut_begin();  it != impl->http_cache.end();  )
+      if(now >= it->second.expiry_time)
+        it = impl->http_cache.erase(it);
+      else {
+        victims.emplace_back(it->second.expiry_time, it->first);
+        ++ it;
+      }
+
+    size_t target = max_http_cache_entries - max_http_cache_entries / 8;
+    if(impl->http_cache.size() <= target)
+      return;
+
+    size_t count = impl->http_cache.size() - target;
+    ::std::nth_element(victims.begin(), victims.begin() + static_cast<ptrdiff_t>(count - 1), victims.end(),
+                       [](const auto& x, const auto& y) { return x.first < y.first;  });
+    for(size_t k = 0;  k != count;  ++k)
+      impl->http_cache.erase(victims[k].second);
+
+    POSEIDON_LOG_DEBUG(("Evicted $1 cached HTTP response(s)"), count);
+  }
+
+void
+do_purge_http_cache(const shptr<Implementation>& impl, const phcow_string& path)
+  {
+    // Cache keys are `<path>?<query>`.
+    for(auto it = impl->http_cache.mut_begin();  it != impl->http_cache.end();  )
+      if((it->first.size() > path.size()) && (it->first.rdstr()[path.size()] == '?')
+         && it->first.rdstr().starts_with(path.rdstr()))
+        it = impl->http_cache.erase(it);
+      else
+        ++ it;
   }
 
 void
@@ -264,6 +770,7 @@ do_server_hws_callback(const shptr<Implementation>& impl,
       {
       case ::poseidon::easy_hws_open:
         {
+          const steady_time login_start_time = steady_clock::now();
           ::poseidon::Network_Reference uri;
           POSEIDON_CHECK(::poseidon::parse_network_reference(uri, data) == data.size());
           phcow_string path = ::poseidon::decode_and_canonicalize_uri_path(uri.path);
@@ -304,8 +811,27 @@ do_server_hws_callback(const shptr<Implementation>& impl,
           POSEIDON_LOG_INFO(("Authenticated `$1` from `$2`"), uinfo.username, session->remote_address());
           session->mut_session_user_data() = uinfo.username.rdstr();
 
+          // The client may ask for MessagePack instead of JSON.
+          bool binary_encoding = false;
+          ::poseidon::HTTP_Query_Parser parser;
+          parser.reload(cow_string(uri.query));
+          while(parser.next_element())
+            if(parser.current_name() == "encoding")
+              binary_encoding = parser.current_value().as_string() == "msgpack";
+
+          // Wait for admission. During a login storm, logins are queued, so
+          // they proceed at database capacity instead of timing out together.
+          if(!do_acquire_login_slot(impl, fiber, session, binary_encoding)) {
+            POSEIDON_LOG_DEBUG(("`$1` disconnected while waiting for login"), uinfo.username);
+            return;
+          }
+
+          const Login_Slot_Guard login_slot_guard(impl);
+
           // Create the user if one doesn't exist. Ensure they can only log in
-          // on a single instance.
+          // on a single instance. The user is upserted, their properties are
+          // fetched, and their roles are listed concurrently, as these requests
+          // don't depend on each other.
           uinfo.login_address = session->remote_address();
           uinfo.login_time = system_clock::now();
 
@@ -336,8 +862,9 @@ do_server_hws_callback(const shptr<Implementation>& impl,
                                       ::poseidon::mysql_connector.allocate_tertiary_connection(),
                                       &insert_into_user, sql_args);
           ::poseidon::task_scheduler.launch(task1);
-          fiber.yield(task1);
 
+          // This may run either before or after the upsert above. If no user
+          // is found, the upsert must have created a new one.
           static constexpr char select_from_user[] =
               R"!!!(
                 SELECT `creation_time`
@@ -350,21 +877,37 @@ do_server_hws_callback(const shptr<Implementation>& impl,
           sql_args.clear();
           sql_args.emplace_back(uinfo.username.rdstr());
 
-          task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
+          auto task3 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
                                       ::poseidon::mysql_connector.allocate_tertiary_connection(),
                                       &select_from_user, sql_args);
-          ::poseidon::task_scheduler.launch(task1);
-          fiber.yield(task1);
+          ::poseidon::task_scheduler.launch(task3);
 
-          if(task1->result_row_count() == 0) {
-            POSEIDON_LOG_FATAL(("Could not find user `$1` in database"), uinfo.username);
-            session->ws_shut_down(::poseidon::ws_status_unexpected_error);
-            return;
+          ::taxon::V_object tx_args;
+          tx_args.try_emplace(&"username", uinfo.username.rdstr());
+
+          auto srv_q = new_sh<Service_Future>(do_find_my_monitor(), &"*role/list", tx_args);
+          service.launch(srv_q);
+
+          when_all(fiber, { task1, task3, srv_q });
+
+          // An empty result means a new user only if the upsert has succeeded;
+          // if it has failed, this throws an exception. Log statements may not
+          // evaluate their arguments, so this is done outside.
+          auto upserted = task1->match_count();
+          POSEIDON_LOG_TRACE(("Upserted user `$1`: $2 row(s) matched"), uinfo.username, upserted);
+
+          if(task3->result_row_count() == 0) {
+            uinfo.creation_time = uinfo.login_time;
+            uinfo.logout_time = uinfo.login_time;
           }
+          else {
+            uinfo.creation_time = task3->result_row(0).at(0).as_system_time();   // SELECT `creation_time`
+            uinfo.logout_time = task3->result_row(0).at(1).as_system_time();     //        , `logout_time`
+            uinfo.banned_until = task3->result_row(0).at(2).as_system_time();    //        , `banned_until`
 
-          uinfo.creation_time = task1->result_row(0).at(0).as_system_time();   // SELECT `creation_time`
-          uinfo.logout_time = task1->result_row(0).at(1).as_system_time();     //        , `logout_time`
-          uinfo.banned_until = task1->result_row(0).at(2).as_system_time();    //        , `banned_until`
+            // The last logout time may not have been written yet.
+            impl->pending_logout_times.find_and_copy(uinfo.logout_time, uinfo.username);
+          }
 
           if(uinfo.login_time < uinfo.banned_until) {
             POSEIDON_LOG_DEBUG(("User `$1` is banned until `$2`"), uinfo.username, uinfo.banned_until);
@@ -372,18 +915,12 @@ do_server_hws_callback(const shptr<Implementation>& impl,
             return;
           }
 
-          // Find my roles.
+          // Cache my roles.
           User_Connection uconn;
           uconn.weak_session = session;
           uconn.rate_time = steady_clock::now();
           uconn.pong_time = uconn.rate_time;
-
-          ::taxon::V_object tx_args;
-          tx_args.try_emplace(&"username", uinfo.username.rdstr());
-
-          auto srv_q = new_sh<Service_Future>(do_find_my_monitor(), &"*role/list", tx_args);
-          service.launch(srv_q);
-          fiber.yield(srv_q);
+          uconn.binary_encoding = binary_encoding;
 
           if(srv_q->response(0).error != "") {
             POSEIDON_LOG_WARN(("Could not list roles of `$1`: $2"), uinfo.username, srv_q->response(0).error);
@@ -392,37 +929,32 @@ do_server_hws_callback(const shptr<Implementation>& impl,
           }
 
           for(const auto& r : srv_q->response(0).obj.at(&"raw_avatars").as_object()) {
-            // For intermediate servers, an avatar is transferred as a JSON
-            // string. We will not send a raw string to the client, so parse it.
-            // Mind a fresh role (that has just been created but has not been
-            // loaded yet), whose avatar is an empty string.
             int64_t roid = 0;
             ::rocket::ascii_numget numg;
             POSEIDON_CHECK(numg.parse_DI(r.first.data(), r.first.length()) == r.first.length());
             numg.cast_I(roid, 0, INT64_MAX);
 
-            ::taxon::V_object avatar;
-            if(r.second.as_string_length() > 0) {
-              ::taxon::Value temp_value;
-              POSEIDON_CHECK(temp_value.parse(r.second.as_string()));
-              avatar = temp_value.as_object();
-            }
-
             POSEIDON_LOG_DEBUG(("Found role `$1` of user `$2`"), roid, uinfo.username);
-            uconn.cached_raw_avatars.try_emplace(roid, avatar);
+            do_set_cached_avatar(uconn, roid, r.second.as_string());
           }
 
           do_publish_user_on_redis(fiber, uinfo, impl->redis_role_ttl);
 
-          if(auto ptr = impl->connections.ptr(uinfo.username))
+          if(auto ptr = impl->connections.ptr(uinfo.username)) {
             if(auto old_session = ptr->weak_session.lock())
               old_session->ws_shut_down(user_ws_status_login_conflict);
 
+            // Channels are bound to sessions, so the old one shall leave.
+            do_leave_all_channels(impl, uinfo.username, *ptr);
+          }
+
           impl->users.insert_or_assign(uinfo.username, uinfo);
           impl->connections.insert_or_assign(uinfo.username, uconn);
+          do_add_to_ping_wheel(impl, uinfo.username, session);
           POSEIDON_LOG_INFO(("`$1` connected from `$2`"), uinfo.username, session->remote_address());
 
           do_welcome_client(impl, fiber, uinfo.username, session);
+          do_record_login_latency(impl, steady_clock::now() - login_start_time);
           break;
         }
 
@@ -433,9 +965,17 @@ do_server_hws_callback(const shptr<Implementation>& impl,
           if(username.empty())
             return;
 
-          tinybuf_ln buf(move(data));
+          // MessagePack is decoded in place. JSON parsing consumes its buffer,
+          // so the frame is parsed from a copy only if some opcodes may have
+          // to be relayed verbatim.
+          const bool binary_encoding = impl->connections.at(username).binary_encoding;
           ::taxon::Value temp_value;
-          POSEIDON_CHECK(temp_value.parse(buf, ::taxon::option_json_mode));
+          if(binary_encoding)
+            POSEIDON_CHECK(msgpack_decode(temp_value, data.data(), data.size()));
+          else {
+            tinybuf_ln buf(impl->opaque_relay_opcodes.empty() ? move(data) : linear_buffer(data));
+            POSEIDON_CHECK(temp_value.parse(buf, ::taxon::option_json_mode));
+          }
           ::taxon::V_object request = temp_value.as_object();
           temp_value.clear();
 
@@ -447,9 +987,15 @@ do_server_hws_callback(const shptr<Implementation>& impl,
           if(auto ptr = request.ptr(&"%serial"))
             serial = *ptr;
 
-          // Check message rate.
-          double rate_limit = impl->client_rate_limit;
+          // Check message rate. The counter is reset periodically.
           auto rate_duration = steady_clock::now() - impl->connections.at(username).rate_time;
+          if(rate_duration >= client_rate_window) {
+            impl->connections.mut(username).rate_time = steady_clock::now();
+            impl->connections.mut(username).rate_counter = 0;
+            rate_duration = 0s;
+          }
+
+          double rate_limit = impl->client_rate_limit;
           if(rate_duration >= 1s)
             rate_limit *= duration_cast<duration<double>>(rate_duration).count();
 
@@ -467,10 +1013,19 @@ do_server_hws_callback(const shptr<Implementation>& impl,
             return;
           }
 
-          // Call the user-defined handler to get response data.
+          // Call the user-defined handler to get response data. An opaque
+          // request is forwarded as is, and its response (which has been
+          // encoded by logic) is sent back as is.
           ::taxon::V_object response;
+          cow_string raw_response;
           try {
-            handler(fiber, username, response, request);
+            if(impl->opaque_relay_opcodes.ptr(opcode)) {
+              ::taxon::V_binary raw_request(reinterpret_cast<const unsigned char*>(data.data()), data.size());
+              do_relay_pass_to_logic(impl, fiber, username, response, raw_response,
+                                     opcode, binary_encoding, raw_request);
+            }
+            else
+              handler(fiber, username, response, request);
             impl->connections.mut(username).pong_time = steady_clock::now();
           }
           catch(exception& stdex) {
@@ -479,16 +1034,21 @@ do_server_hws_callback(const shptr<Implementation>& impl,
             return;
           }
 
+          if(!raw_response.empty()) {
+            session->ws_send(binary_encoding ? ::poseidon::ws_BINARY : ::poseidon::ws_TEXT,
+                             ::poseidon::chars_view(raw_response.data(), raw_response.size()));
+            break;
+          }
+
           if(serial.is_null())
             break;
 
           // The client expects a response, so send it.
           response.try_emplace(&"%serial", serial);
-          temp_value = response;
 
-          buf.clear_buffer();
-          temp_value.print_to(buf, ::taxon::option_json_mode);
-          session->ws_send(::poseidon::ws_TEXT, buf);
+          Client_Message msg;
+          msg.value = response;
+          do_send_client_message(session, binary_encoding, msg);
           break;
         }
 
@@ -511,6 +1071,7 @@ do_server_hws_callback(const shptr<Implementation>& impl,
 
           User_Connection uconn;
           impl->connections.find_and_erase(uconn, username);
+          do_leave_all_channels(impl, username, uconn);
 
           if(uconn.current_roid != 0) {
             // Notify the logic server that the client has disconnected. If the
@@ -523,23 +1084,12 @@ do_server_hws_callback(const shptr<Implementation>& impl,
             fiber.yield(srv_q);
           }
 
-          // Update logout time.
-          static constexpr char update_user_logout_time[] =
-              R"!!!(
-                UPDATE `user`
-                  SET `logout_time` = ?
-                  WHERE `username` = ?
-              )!!!";
-
-          cow_vector<::poseidon::MySQL_Value> sql_args;
-          sql_args.emplace_back(system_clock::now());
-          sql_args.emplace_back(username.rdstr());
-
-          auto task2 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
-                                      ::poseidon::mysql_connector.allocate_tertiary_connection(),
-                                      &update_user_logout_time, sql_args);
-          ::poseidon::task_scheduler.launch(task2);
-          fiber.yield(task2);
+          // Update logout time. This is buffered and written in batches, so
+          // mass disconnects don't flood the database. If the buffer is full,
+          // flush it now.
+          impl->pending_logout_times.insert_or_assign(username, system_clock::now());
+          if(impl->pending_logout_times.size() > max_pending_logouts)
+            do_flush_logout_times(impl, fiber, SIZE_MAX);
 
           POSEIDON_LOG_INFO(("`$1` disconnected from `$2`"), username, session->remote_address());
           break;
@@ -552,36 +1102,72 @@ do_server_hws_callback(const shptr<Implementation>& impl,
           POSEIDON_CHECK(::poseidon::parse_network_reference(uri, data) == data.size());
           phcow_string path = ::poseidon::decode_and_canonicalize_uri_path(uri.path);
 
-          // Copy the handler, in case of fiber context switches.
-          User_Service::http_handler_type handler;
-          impl->http_handlers.find_and_copy(handler, path);
-          if(!handler) {
-            session->http_shut_down(::poseidon::http_status_not_found);
-            return;
-          }
+          // If caching is enabled for this path, try serving a cached
+          // response, which costs only a lookup.
+          seconds cache_ttl = 0s;
+          impl->http_cache_ttls.find_and_copy(cache_ttl, path);
+          phcow_string cache_key = sformat("$1?$2", path, uri.query);
+          HTTP_Cache_Entry entry;
+          if((cache_ttl > 0s) && impl->http_cache.find_and_copy(entry, cache_key)
+             && (steady_clock::now() < entry.expiry_time))
+            POSEIDON_LOG_TRACE(("HTTP cache hit: $1"), cache_key);
+          else {
+            // Copy the handler, in case of fiber context switches.
+            User_Service::http_handler_type handler;
+            impl->http_handlers.find_and_copy(handler, path);
+            if(!handler) {
+              session->http_shut_down(::poseidon::http_status_not_found);
+              return;
+            }
 
-          // Call the user-defined handler to get response data.
-          cow_string response_content_type;
-          cow_string response_payload;
-          try {
-            handler(fiber, response_content_type, response_payload, cow_string(uri.query));
-          }
-          catch(exception& stdex) {
-            POSEIDON_LOG_ERROR(("Unhandled exception in `$1 $2`: $3"), path, uri.query, stdex);
-            session->http_shut_down(::poseidon::http_status_bad_request);
-            return;
-          }
+            // Call the user-defined handler to get response data.
+            entry.content_type.clear();
+            entry.payload.clear();
+            try {
+              handler(fiber, entry.content_type, entry.payload, cow_string(uri.query));
+            }
+            catch(exception& stdex) {
+              POSEIDON_LOG_ERROR(("Unhandled exception in `$1 $2`: $3"), path, uri.query, stdex);
+              session->http_shut_down(::poseidon::http_status_bad_request);
+              return;
+            }
 
-          // Ensure there's `Content-Type`.
-          if(response_content_type.empty() && !response_payload.empty())
-            response_content_type = &"application/octet-stream";
+            // Ensure there's `Content-Type`.
+            if(entry.content_type.empty() && !entry.payload.empty())
+              entry.content_type = &"application/octet-stream";
+
+            if(cache_ttl > 0s) {
+              // Tag the response with a checksum of its payload.
+              uint8_t checksum[16];
+              ::MD5(reinterpret_cast<const uint8_t*>(entry.payload.data()), entry.payload.size(), checksum);
+              char etag[35];
+              etag[0] = '"';
+              ::poseidon::hex_encode_16_partial(etag + 1, checksum);
+              etag[33] = '"';
+              etag[34] = 0;
+
+              entry.etag = etag;
+              entry.expiry_time = steady_clock::now() + cache_ttl;
+              if(!impl->http_cache.count(cache_key)
+                 && (impl->http_cache.size() >= max_http_cache_entries))
+                do_evict_http_cache(impl);
+              impl->http_cache.insert_or_assign(cache_key, entry);
+            }
+          }
 
-          // Make an HTTP response.
+          // Make an HTTP response. A cached response may be cached by clients
+          // and proxies for the rest of its lifetime.
           ::poseidon::HTTP_S_Headers resp;
           resp.status = ::poseidon::http_status_ok;
-          resp.headers.emplace_back(&"Cache-Control", &"no-cache");
-          resp.headers.emplace_back(&"Content-Type", response_content_type);
-          session->http_response(event == ::poseidon::easy_hws_head, move(resp), response_payload);
+          if(cache_ttl <= 0s)
+            resp.headers.emplace_back(&"Cache-Control", &"no-cache");
+          else {
+            auto max_age = duration_cast<seconds>(entry.expiry_time - steady_clock::now());
+            resp.headers.emplace_back(&"Cache-Control", sformat("max-age=$1", ::std::max(max_age.count(), 0L)));
+            resp.headers.emplace_back(&"ETag", entry.etag);
+          }
+          resp.headers.emplace_back(&"Content-Type", entry.content_type);
+          session->http_response(event == ::poseidon::easy_hws_head, move(resp), entry.payload);
           break;
         }
       }
@@ -687,11 +1273,28 @@ do_mysql_check_table_nickname(::poseidon::Abstract_Fiber& fiber)
   }
 
 void
-do_star_nickname_acquire(const shptr<Implementation>& /*impl*/, ::poseidon::Abstract_Fiber& fiber,
+do_set_nickname_owner(const shptr<Implementation>& impl, const phcow_string& nickname,
+                      const phcow_string& username)
+  {
+    impl->nickname_index.insert_or_assign(nickname, username);
+    if(impl->nickname_index_rebuilding)
+      impl->nickname_changes.push_back({ nickname, username, false });
+  }
+
+void
+do_forget_nickname_owner(const shptr<Implementation>& impl, const phcow_string& nickname)
+  {
+    impl->nickname_index.erase(nickname);
+    if(impl->nickname_index_rebuilding)
+      impl->nickname_changes.push_back({ nickname, phcow_string(), true });
+  }
+
+void
+do_star_nickname_acquire(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
                          const ::poseidon::UUID& /*request_service_uuid*/,
                          ::taxon::V_object& response, const ::taxon::V_object& request)
   {
-    cow_string nickname = request.at(&"nickname").as_string();
+    phcow_string nickname = request.at(&"nickname").as_string();
     POSEIDON_CHECK(nickname != "");
 
     phcow_string username = request.at(&"username").as_string();
@@ -699,6 +1302,17 @@ do_star_nickname_acquire(const shptr<Implementation>& /*impl*/, ::poseidon::Abst
 
     ////////////////////////////////////////////////////////////
     //
+    // Reject known conflicts without touching MySQL. A nickname that has been
+    // released on another agent stays in the index until the next rebuild, so
+    // it may be rejected for up to an hour. A nickname that is not in the
+    // index may still have been taken, so the insertion below is authoritative.
+    phcow_string owner;
+    if(impl->nickname_index.find_and_copy(owner, nickname) && (owner != username)) {
+      POSEIDON_LOG_DEBUG(("Nickname `$1` has been taken by `$2`"), nickname, owner);
+      response.try_emplace(&"status", &"gs_nickname_conflict");
+      return;
+    }
+
     static constexpr char insert_into_nickname[] =
         R"!!!(
           INSERT IGNORE INTO `nickname`
@@ -708,7 +1322,7 @@ do_star_nickname_acquire(const shptr<Implementation>& /*impl*/, ::poseidon::Abst
         )!!!";
 
     cow_vector<::poseidon::MySQL_Value> sql_args;
-    sql_args.emplace_back(nickname);               // SET `nickname` = ?
+    sql_args.emplace_back(nickname.rdstr());       // SET `nickname` = ?
     sql_args.emplace_back(username.rdstr());       //     , `username` = ?
     sql_args.emplace_back(system_clock::now());    //     , `creation_time` = ?
 
@@ -733,7 +1347,7 @@ do_star_nickname_acquire(const shptr<Implementation>& /*impl*/, ::poseidon::Abst
           )!!!";
 
       sql_args.clear();
-      sql_args.emplace_back(nickname);          // WHERE `nickname` = ?
+      sql_args.emplace_back(nickname.rdstr());  // WHERE `nickname` = ?
       sql_args.emplace_back(username.rdstr());  //       AND `username` = ?
 
       task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
@@ -743,6 +1357,8 @@ do_star_nickname_acquire(const shptr<Implementation>& /*impl*/, ::poseidon::Abst
       fiber.yield(task1);
 
       if(task1->result_row_count() == 0) {
+        // The owner is unknown, but it's not me.
+        do_set_nickname_owner(impl, nickname, phcow_string());
         response.try_emplace(&"status", &"gs_nickname_conflict");
         return;
       }
@@ -750,6 +1366,7 @@ do_star_nickname_acquire(const shptr<Implementation>& /*impl*/, ::poseidon::Abst
       serial = task1->result_row(0).at(0).as_integer();  // SELECT `serial`
     }
 
+    do_set_nickname_owner(impl, nickname, username);
     POSEIDON_LOG_INFO(("Acquired nickname `$1`"), nickname);
 
     response.try_emplace(&"serial", serial);
@@ -757,11 +1374,11 @@ do_star_nickname_acquire(const shptr<Implementation>& /*impl*/, ::poseidon::Abst
   }
 
 void
-do_star_nickname_release(const shptr<Implementation>& /*impl*/, ::poseidon::Abstract_Fiber& fiber,
+do_star_nickname_release(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
                          const ::poseidon::UUID& /*request_service_uuid*/,
                          ::taxon::V_object& response, const ::taxon::V_object& request)
   {
-    cow_string nickname = request.at(&"nickname").as_string();
+    phcow_string nickname = request.at(&"nickname").as_string();
     POSEIDON_CHECK(nickname != "");
 
     ////////////////////////////////////////////////////////////
@@ -773,7 +1390,7 @@ do_star_nickname_release(const shptr<Implementation>& /*impl*/, ::poseidon::Abst
         )!!!";
 
     cow_vector<::poseidon::MySQL_Value> sql_args;
-    sql_args.emplace_back(nickname);               // WHERE `nickname` = ?
+    sql_args.emplace_back(nickname.rdstr());       // WHERE `nickname` = ?
 
     auto task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
                                ::poseidon::mysql_connector.allocate_tertiary_connection(),
@@ -781,6 +1398,8 @@ do_star_nickname_release(const shptr<Implementation>& /*impl*/, ::poseidon::Abst
     ::poseidon::task_scheduler.launch(task1);
     fiber.yield(task1);
 
+    do_forget_nickname_owner(impl, nickname);
+
     if(task1->match_count() == 0) {
       response.try_emplace(&"status", &"gs_nickname_not_found");
       return;
@@ -791,6 +1410,128 @@ do_star_nickname_release(const shptr<Implementation>& /*impl*/, ::poseidon::Abst
     response.try_emplace(&"status", &"gs_ok");
   }
 
+void
+do_sync_nickname_index(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber)
+  {
+    // Nicknames that have been acquired on other agents are picked up
+    // incrementally. As releases on other agents are not visible, the index is
+    // rebuilt from scratch every hour. Changes that are made on this agent
+    // during a rebuild are recorded, and applied to the new index afterwards.
+    cow_dictionary<phcow_string> index;
+    int64_t serial = 0;
+    bool rebuild = (impl->nickname_index_serial == 0)
+                   || (steady_clock::now() - impl->nickname_index_rebuild_time >= 1h);
+    if(rebuild) {
+      impl->nickname_index_rebuild_time = steady_clock::now();
+      impl->nickname_index_rebuilding = true;
+      impl->nickname_changes.clear();
+    }
+    else
+      serial = impl->nickname_index_serial;
+
+    static constexpr char select_from_nickname[] =
+        R"!!!(
+          SELECT `serial`
+                 , `nickname`
+                 , `username`
+            FROM `nickname`
+            WHERE `serial` > ?
+            ORDER BY `serial`
+            LIMIT 10000
+        )!!!";
+
+    for(;;) {
+      cow_vector<::poseidon::MySQL_Value> sql_args;
+      sql_args.emplace_back(serial);      // WHERE `serial` > ?
+
+      auto task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
+                                 ::poseidon::mysql_connector.allocate_tertiary_connection(),
+                                 &select_from_nickname, sql_args);
+      ::poseidon::task_scheduler.launch(task1);
+      fiber.yield(task1);
+
+      auto& target = rebuild ? index : impl->nickname_index;
+      for(size_t k = 0;  k != task1->result_row_count();  ++k) {
+        serial = task1->result_row(k).at(0).as_integer();              // SELECT `serial`
+        phcow_string nickname = task1->result_row(k).at(1).as_blob();  //        , `nickname`
+        phcow_string username = task1->result_row(k).at(2).as_blob();  //        , `username`
+        target.insert_or_assign(nickname, username);
+      }
+
+      if(task1->result_row_count() < 10000)
+        break;
+    }
+
+    if(rebuild) {
+      for(const auto& change : impl->nickname_changes)
+        if(change.released)
+          index.erase(change.nickname);
+        else
+          index.insert_or_assign(change.nickname, change.username);
+
+      POSEIDON_LOG_INFO(("Loaded $1 nickname(s) into index, with $2 change(s) during loading"),
+                        index.size(), impl->nickname_changes.size());
+      impl->nickname_index.swap(index);
+      impl->nickname_index_rebuilding = false;
+      impl->nickname_changes.clear();
+    }
+
+    impl->nickname_index_serial = ::std::max(impl->nickname_index_serial, serial);
+  }
+
+void
+do_nickname_sync_timer_callback(const shptr<Implementation>& impl,
+                                const shptr<::poseidon::Abstract_Timer>& /*timer*/,
+                                ::poseidon::Abstract_Fiber& fiber, steady_time /*now*/)
+  {
+    if(!impl->db_ready || impl->nickname_sync_running)
+      return;
+
+    // A rebuild may take several queries, so it shall not overlap with the
+    // next one.
+    impl->nickname_sync_running = true;
+    try {
+      do_sync_nickname_index(impl, fiber);
+    }
+    catch(...) {
+      impl->nickname_sync_running = false;
+      impl->nickname_index_rebuilding = false;
+      impl->nickname_changes.clear();
+      throw;
+    }
+    impl->nickname_sync_running = false;
+  }
+
+void
+do_login_queue_timer_callback(const shptr<Implementation>& impl,
+                              const shptr<::poseidon::Abstract_Timer>& /*timer*/,
+                              ::poseidon::Abstract_Fiber& /*fiber*/, steady_time /*now*/)
+  {
+    // Tell waiting clients their positions in the queue. Tickets of clients
+    // that have disconnected are cancelled.
+    size_t position = 0;
+    auto it = impl->login_queue.begin();
+    while(it != impl->login_queue.end()) {
+      auto session = (*it)->weak_session.lock();
+      if(session) {
+        ::taxon::V_object tx_args;
+        tx_args.try_emplace(&"%opcode", &"=user/login_queue");
+        tx_args.try_emplace(&"position", static_cast<int64_t>(position + 1));
+
+        Client_Message msg;
+        msg.value = tx_args;
+        if(do_send_client_message(session, (*it)->binary_encoding, msg)) {
+          position ++;
+          ++ it;
+          continue;
+        }
+      }
+
+      (*it)->complete(false);
+      it = impl->login_queue.erase(it);
+    }
+  }
+
 void
 do_ping_timer_callback(const shptr<Implementation>& impl,
                        const shptr<::poseidon::Abstract_Timer>& /*timer*/,
@@ -803,36 +1544,65 @@ do_ping_timer_callback(const shptr<Implementation>& impl,
       impl->db_ready = true;
     }
 
-    // Ping clients, and mark connections that have been inactive for a couple
-    // of intervals.
-    for(auto it = impl->connections.mut_begin();  it != impl->connections.end();  ++it) {
-      auto session = it->second.weak_session.lock();
+    // Purge expired HTTP responses.
+    for(auto it = impl->http_cache.mut_begin();  it != impl->http_cache.end();  )
+      if(now >= it->second.expiry_time)
+        it = impl->http_cache.erase(it);
+      else
+        ++ it;
+  }
+
+void
+do_ping_wheel_timer_callback(const shptr<Implementation>& impl,
+                             const shptr<::poseidon::Abstract_Timer>& /*timer*/,
+                             ::poseidon::Abstract_Fiber& /*fiber*/, steady_time now)
+  {
+    // Visit the next slot. Only connections in this slot are checked.
+    auto& slot = impl->ping_wheel.at(impl->ping_wheel_cursor);
+    impl->ping_wheel_cursor = (impl->ping_wheel_cursor + 1) % impl->ping_wheel.size();
+
+    size_t count = 0;
+    for(size_t k = 0;  k != slot.size();  ++k) {
+      // Drop entries of sessions that have been replaced or closed.
+      const auto& entry = slot.at(k);
+      auto ptr = impl->connections.ptr(entry.username);
+      if(!ptr || ptr->weak_session.owner_before(entry.weak_session)
+         || entry.weak_session.owner_before(ptr->weak_session))
+        continue;
+
+      // Ping the client, and mark the connection if it has been inactive for
+      // a couple of intervals.
+      auto session = ptr->weak_session.lock();
       if(!session) {
-        impl->expired_username_list.emplace_back(it->first);
+        impl->expired_username_list.emplace_back(entry.username);
         continue;
       }
 
-      if(now - it->second.pong_time > impl->client_ping_interval * 3) {
-        POSEIDON_LOG_DEBUG(("PING timed out: username `$1`"), it->first);
+      if(now - ptr->pong_time > impl->client_ping_interval * 3) {
+        POSEIDON_LOG_DEBUG(("PING timed out: username `$1`"), entry.username);
         session->ws_shut_down(user_ws_status_ping_timeout);
-        impl->expired_username_list.emplace_back(it->first);
+        impl->expired_username_list.emplace_back(entry.username);
         continue;
       }
 
-      it->second.rate_time = now;
-      it->second.rate_counter = 0;
-
-      if(now - it->second.pong_time > impl->client_ping_interval)
+      if(now - ptr->pong_time > impl->client_ping_interval)
         session->ws_send(::poseidon::ws_PING, "");
+
+      if(count != k)
+        slot.at(count) = move(slot.at(k));
+      count ++;
     }
+    slot.resize(count);
 
     while(impl->expired_username_list.size() != 0) {
       phcow_string username = move(impl->expired_username_list.back());
       impl->expired_username_list.pop_back();
 
       POSEIDON_LOG_DEBUG(("Unloading user information: $1"), username);
+      User_Connection uconn;
       impl->users.erase(username);
-      impl->connections.erase(username);
+      impl->connections.find_and_erase(uconn, username);
+      do_leave_all_channels(impl, username, uconn);
     }
   }
 
@@ -841,20 +1611,83 @@ do_check_user_timer_callback(const shptr<Implementation>& impl,
                              const shptr<::poseidon::Abstract_Timer>& /*timer*/,
                              ::poseidon::Abstract_Fiber& fiber, steady_time /*now*/)
   {
-    ::std::vector<phcow_string> username_list;
-    username_list.reserve(impl->users.size());
-    for(const auto& r : impl->users)
-      username_list.emplace_back(r.first);
+    if(impl->refresh_username_list.empty()) {
+      // Report login latencies since the last cycle, if there were any logins.
+      const auto& counts = impl->login_latency_counts;
+      if(::std::any_of(counts, ::std::end(counts), [](uint32_t n) { return n != 0;  }))
+        POSEIDON_LOG_INFO((
+            "Login latency histogram: <50ms: $1, <100ms: $2, <200ms: $3, <500ms: $4, "
+            "<1s: $5, <2s: $6, <5s: $7, >=5s: $8"),
+            counts[0], counts[1], counts[2], counts[3], counts[4], counts[5], counts[6], counts[7]);
+      ::std::fill(impl->login_latency_counts, ::std::end(impl->login_latency_counts), 0U);
+
+      // Report login admission since the last cycle.
+      POSEIDON_LOG_INFO((
+          "Login admission: admitted: $1, average wait: $2, maximum wait: $3, in progress: $4, "
+          "queued: $5"),
+          impl->login_admitted_count,
+          duration_cast<milliseconds>(impl->login_wait_total / ::std::max(impl->login_admitted_count, 1U)),
+          duration_cast<milliseconds>(impl->login_wait_max), impl->logins_in_progress,
+          impl->login_queue.size());
+      impl->login_admitted_count = 0;
+      impl->login_wait_total = steady_clock::duration::zero();
+      impl->login_wait_max = steady_clock::duration::zero();
+
+      // Start a new cycle. All users shall be refreshed once per cycle, and the
+      // work is spread evenly across ticks, instead of being done all at once.
+      impl->refresh_username_list.reserve(impl->users.size());
+      for(const auto& r : impl->users)
+        impl->refresh_username_list.emplace_back(r.first);
+
+      impl->refresh_count_per_tick = (impl->refresh_username_list.size() + check_user_ticks_per_cycle - 1)
+                                     / check_user_ticks_per_cycle;
+    }
 
-    while(!username_list.empty()) {
-      auto username = move(username_list.back());
-      username_list.pop_back();
+    // Extend TTLs of users of this slice. Login conflicts have been checked when
+    // users logged in, so it's not necessary to rewrite their records. Only if
+    // a record has expired, shall it be published again.
+    static constexpr char redis_expire_all[] =
+        R"!!!(
+          local missing = { }
+          for i = 1, #KEYS do
+            if redis.call('EXPIRE', KEYS[i], ARGV[1]) == 0 then
+              missing[#missing + 1] = i
+            end
+          end
+          return missing
+        )!!!";
 
-      User_Record uinfo;
-      if(!impl->users.find_and_copy(uinfo, username))
-        continue;
+    size_t count = ::std::min(impl->refresh_count_per_tick, impl->refresh_username_list.size());
+    while(count != 0) {
+      ::std::vector<phcow_string> username_list;
+      cow_vector<cow_string> redis_cmd;
+      redis_cmd.emplace_back(&"EVAL");
+      redis_cmd.emplace_back(&redis_expire_all);
+      redis_cmd.emplace_back();  // number of keys
+
+      while((count != 0) && (username_list.size() < 1000)) {
+        username_list.emplace_back(move(impl->refresh_username_list.back()));
+        impl->refresh_username_list.pop_back();
+        count --;
+        redis_cmd.emplace_back(sformat("$1/user/$2", service.application_name(), username_list.back()));
+      }
+
+      redis_cmd.mut(2) = sformat("$1", username_list.size());
+      redis_cmd.emplace_back(sformat("$1", impl->redis_role_ttl.count()));  // ARGV[1]
+
+      auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
+      ::poseidon::task_scheduler.launch(task2);
+      fiber.yield(task2);
 
-      do_publish_user_on_redis(fiber, uinfo, impl->redis_role_ttl);
+      for(const auto& r : task2->result().as_array()) {
+        size_t index = static_cast<size_t>(r.as_integer() - 1);
+        User_Record uinfo;
+        if(!impl->users.find_and_copy(uinfo, username_list.at(index)))
+          continue;
+
+        POSEIDON_LOG_DEBUG(("User `$1` expired on Redis; publishing again"), uinfo.username);
+        do_publish_user_on_redis(fiber, uinfo, impl->redis_role_ttl);
+      }
     }
   }
 
@@ -947,17 +1780,112 @@ do_star_user_push_message(const shptr<Implementation>& impl, ::poseidon::Abstrac
 
     ////////////////////////////////////////////////////////////
     //
-    tinybuf_ln buf;
+    client_data.try_emplace(&"%opcode", client_opcode);
+    Client_Message msg;
+    msg.value = client_data;
+
     for(const auto& username : username_list)
       if(auto uconn = impl->connections.ptr(username))
-        if(auto session = uconn->weak_session.lock()) {
-          if(buf.size() == 0) {
-            ::taxon::V_object obj = client_data;
-            obj.try_emplace(&"%opcode", client_opcode);
-            ::taxon::Value(obj).print_to(buf, ::taxon::option_json_mode);
-          }
-          session->ws_send(::poseidon::ws_TEXT, buf);
-        }
+        if(auto session = uconn->weak_session.lock())
+          do_send_client_message(session, uconn->binary_encoding, msg);
+  }
+
+void
+do_star_channel_join(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& /*fiber*/,
+                     const ::poseidon::UUID& /*request_service_uuid*/,
+                     ::taxon::V_object& response, const ::taxon::V_object& request)
+  {
+    phcow_string channel = request.at(&"channel").as_string();
+    POSEIDON_CHECK(channel != "");
+
+    ::std::vector<phcow_string> username_list;
+    if(auto plist = request.ptr(&"username_list"))
+      for(const auto& r : plist->as_array())
+        username_list.emplace_back(r.as_string());
+
+    if(auto ptr = request.ptr(&"username"))
+      username_list.emplace_back(ptr->as_string());
+
+    ////////////////////////////////////////////////////////////
+    //
+    for(const auto& username : username_list)
+      if(auto uconn = impl->connections.mut_ptr(username))
+        if(auto session = uconn->weak_session.lock())
+          if(impl->channels.open(channel).insert_or_assign(username, session).second)
+            uconn->channels.emplace_back(channel);
+
+    response.try_emplace(&"status", &"gs_ok");
+  }
+
+void
+do_star_channel_leave(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& /*fiber*/,
+                      const ::poseidon::UUID& /*request_service_uuid*/,
+                      ::taxon::V_object& response, const ::taxon::V_object& request)
+  {
+    phcow_string channel = request.at(&"channel").as_string();
+    POSEIDON_CHECK(channel != "");
+
+    ::std::vector<phcow_string> username_list;
+    if(auto plist = request.ptr(&"username_list"))
+      for(const auto& r : plist->as_array())
+        username_list.emplace_back(r.as_string());
+
+    if(auto ptr = request.ptr(&"username"))
+      username_list.emplace_back(ptr->as_string());
+
+    ////////////////////////////////////////////////////////////
+    //
+    auto members = impl->channels.mut_ptr(channel);
+    if(!members) {
+      response.try_emplace(&"status", &"gs_channel_not_found");
+      return;
+    }
+
+    for(const auto& username : username_list)
+      if(members->erase(username))
+        if(auto uconn = impl->connections.mut_ptr(username))
+          for(size_t k = 0;  k != uconn->channels.size();  ++k)
+            if(uconn->channels[k] == channel) {
+              uconn->channels.mut(k) = uconn->channels.back();
+              uconn->channels.pop_back();
+              break;
+            }
+
+    if(members->empty())
+      impl->channels.erase(channel);
+
+    response.try_emplace(&"status", &"gs_ok");
+  }
+
+void
+do_star_channel_push_message(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& /*fiber*/,
+                             const ::poseidon::UUID& /*request_service_uuid*/,
+                             ::taxon::V_object& /*response*/, const ::taxon::V_object& request)
+  {
+    phcow_string channel = request.at(&"channel").as_string();
+    POSEIDON_CHECK(channel != "");
+
+    cow_string client_opcode = request.at(&"client_opcode").as_string();
+    POSEIDON_CHECK(client_opcode != "");
+
+    ::taxon::V_object client_data;
+    if(auto ptr = request.ptr(&"client_data"))
+      client_data = ptr->as_object();
+
+    ////////////////////////////////////////////////////////////
+    //
+    auto members = impl->channels.ptr(channel);
+    if(!members)
+      return;
+
+    client_data.try_emplace(&"%opcode", client_opcode);
+    Client_Message msg;
+    msg.value = client_data;
+
+    for(const auto& r : *members)
+      if(auto session = r.second.lock())
+        if(auto uconn = impl->connections.ptr(r.first))
+          do_send_client_message(session, uconn->binary_encoding, msg);
   }
 
 void
@@ -995,10 +1923,98 @@ do_relay_forward_to_logic(const shptr<Implementation>& impl, ::poseidon::Abstrac
       response = ptr->as_object();
   }
 
+uint64_t
+do_relay_hash(uint64_t seed, const char* str, size_t len)
+  {
+    // This is FNV-1a, followed by the finalizer of SplitMix64, so similar keys
+    // are spread apart.
+    uint64_t hash = seed;
+    for(size_t k = 0;  k != len;  ++k)
+      hash = (hash ^ static_cast<unsigned char>(str[k])) * 0x100000001B3ULL;
+
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+    return hash ^ (hash >> 31);
+  }
+
+void
+do_relay_forward_to_service(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
+                            const phcow_string& username, ::taxon::V_object& response,
+                            const ::taxon::V_object& request)
+  {
+    const phcow_string opcode = request.at(&"%opcode").as_string();
+    auto route_ptr = impl->relay_routes.ptr(opcode);
+    if(!route_ptr) {
+      response.try_emplace(&"status", &"sc_opcode_denied");
+      return;
+    }
+
+    // Copy the route, in case of fiber context switches.
+    const Relay_Route route = *route_ptr;
+
+    const int64_t roid = impl->connections.at(username).current_roid;
+    if((route.shard == relay_shard_roid) && (roid == 0)) {
+      response.try_emplace(&"status", &"sc_no_role_selected");
+      return;
+    }
+
+    // Select a target service. Rendezvous hashing is used, where the service
+    // with the highest score wins, so only keys of a service that has gone are
+    // moved elsewhere.
+    cow_string key;
+    if(route.shard == relay_shard_roid)
+      key = sformat("$1", roid);
+    else
+      key = username.rdstr();
+
+    const uint64_t key_hash = do_relay_hash(0xCBF29CE484222325ULL, key.data(), key.size());
+    ::poseidon::UUID target_service_uuid;
+    uint64_t best_score = 0;
+    double load_factor = HUGE_VAL;
+    for(const auto& r : service.all_service_records())
+      if((r.second.zone_id == service.zone_id()) && (r.second.service_type == route.service_type)) {
+        if(route.shard == relay_shard_load) {
+          if(r.second.load_factor < load_factor) {
+            target_service_uuid = r.first;
+            load_factor = r.second.load_factor;
+          }
+        }
+        else {
+          cow_string uuid_str = r.first.to_string();
+          uint64_t score = do_relay_hash(key_hash, uuid_str.data(), uuid_str.size());
+          if(target_service_uuid.is_nil() || (score > best_score)) {
+            target_service_uuid = r.first;
+            best_score = score;
+          }
+        }
+      }
+
+    if(target_service_uuid.is_nil())
+      POSEIDON_THROW(("No `$1` service online"), route.service_type);
+
+    ::taxon::V_object tx_args;
+    tx_args.try_emplace(&"roid", roid);
+    tx_args.try_emplace(&"username", username.rdstr());
+    tx_args.try_emplace(&"client_opcode", opcode.rdstr());
+    tx_args.try_emplace(&"client_req", request);
+
+    auto srv_q = new_sh<Service_Future>(target_service_uuid, &"*role/on_client_request", tx_args);
+    service.launch(srv_q);
+    fiber.yield(srv_q);
+
+    if(srv_q->response(0).error != "")
+      POSEIDON_THROW(("Could not forward client request: $1"), srv_q->response(0).error);
+
+    if(auto ptr = srv_q->response(0).obj.ptr(&"client_resp"))
+      response = ptr->as_object();
+  }
+
 void
 do_reload_relay_conf(const shptr<Implementation>& impl)
   {
     cow_dictionary<User_Service::ws_handler_type> temp_ws_handlers;
+    cow_dictionary<bool> temp_opaque_relay_opcodes;
+    cow_dictionary<Relay_Route> temp_relay_routes;
     ::poseidon::Config_File conf_file(&"relay.conf");
 
     for(const auto& r : conf_file.root()) {
@@ -1013,11 +2029,39 @@ do_reload_relay_conf(const shptr<Implementation>& impl)
       if(r.first.empty() || r.second.as_string().empty())
         continue;
 
+      // A rule may also be `<service type>@<shard key>`, where the shard key
+      // is one of `roid`, `username` and `load`.
+      const auto& rule = r.second.as_string();
+      size_t at_pos = rule.find('@');
+
       User_Service::ws_handler_type handler;
-      if(r.second.as_string() == "denied")
+      if(rule == "denied")
         handler = bindw(impl, do_relay_deny);
-      else if(r.second.as_string() == "logic")
+      else if(rule == "logic")
         handler = bindw(impl, do_relay_forward_to_logic);
+      else if(rule == "logic_opaque") {
+        handler = bindw(impl, do_relay_forward_to_logic);
+        temp_opaque_relay_opcodes.insert_or_assign(r.first, true);
+      }
+      else if((at_pos != 0) && (at_pos != cow_string::npos)) {
+        Relay_Route route;
+        route.service_type = rule.substr(0, at_pos);
+        const cow_string shard_key = rule.substr(at_pos + 1);
+        if(shard_key == "roid")
+          route.shard = relay_shard_roid;
+        else if(shard_key == "username")
+          route.shard = relay_shard_username;
+        else if(shard_key == "load")
+          route.shard = relay_shard_load;
+        else
+          POSEIDON_THROW((
+              "Invalid `$1`: unknown shard key in relay rule `$2`",
+              "[in configuration file '$3']"),
+              r.first, r.second, conf_file.path());
+
+        handler = bindw(impl, do_relay_forward_to_service);
+        temp_relay_routes.insert_or_assign(r.first, route);
+      }
       else
         POSEIDON_THROW((
             "Invalid `$1`: unknown relay rule `$2`",
@@ -1034,6 +2078,9 @@ do_reload_relay_conf(const shptr<Implementation>& impl)
     for(const auto& r : temp_ws_handlers)
       impl->ws_handlers.insert_or_assign(r.first, r.second);
 
+    impl->opaque_relay_opcodes = temp_opaque_relay_opcodes;
+    impl->relay_routes = temp_relay_routes;
+
     POSEIDON_LOG_INFO(("Reloaded relay rules for client opcodes from '$1'"), conf_file.path());
   }
 
@@ -1149,34 +2196,19 @@ do_plus_role_create(const shptr<Implementation>& impl, ::poseidon::Abstract_Fibe
 
     ////////////////////////////////////////////////////////////
     //
-    if(impl->connections.at(username).cached_raw_avatars.size() >= impl->max_number_of_roles_per_user) {
+    if(impl->connections.at(username).cached_avatars.size() >= impl->max_number_of_roles_per_user) {
       response.try_emplace(&"status", &"sc_too_many_roles");
       return;
     }
 
-    int nickname_length = 0;
-    size_t offset = 0;
-    while(offset < nickname.size()) {
-      char32_t cp;
-      if(!::asteria::utf8_decode(cp, nickname, offset)) {
-        response.try_emplace(&"status", &"sc_nickname_invalid");
-        return;
-      }
-
-      int w = ::wcwidth(static_cast<wchar_t>(cp));
-      if(w <= 0) {
-        response.try_emplace(&"status", &"sc_nickname_invalid");
-        return;
-      }
-
-      nickname_length += w;
-      if(nickname_length > impl->nickname_length_limits[1]) {
-        response.try_emplace(&"status", &"sc_nickname_length_error");
-        return;
-      }
+    int nickname_length = utf8_display_width(nickname);
+    if(nickname_length < 0) {
+      response.try_emplace(&"status", &"sc_nickname_invalid");
+      return;
     }
 
-    if(nickname_length < impl->nickname_length_limits[0]) {
+    if((nickname_length < impl->nickname_length_limits[0])
+       || (nickname_length > impl->nickname_length_limits[1])) {
       response.try_emplace(&"status", &"sc_nickname_length_error");
       return;
     }
@@ -1217,7 +2249,7 @@ do_plus_role_create(const shptr<Implementation>& impl, ::poseidon::Abstract_Fibe
       return;
     }
 
-    impl->connections.mut(username).cached_raw_avatars.try_emplace(roid);
+    do_set_cached_avatar(impl->connections.mut(username), roid, &"");
 
     do_role_login_common(impl, fiber, username, roid);
 
@@ -1239,7 +2271,7 @@ do_plus_role_login(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber
       return;
     }
 
-    if(impl->connections.at(username).cached_raw_avatars.count(roid) == 0) {
+    if(impl->connections.at(username).cached_avatars.count(roid) == 0) {
       response.try_emplace(&"status", &"sc_role_unavailable");
       return;
     }
@@ -1271,6 +2303,10 @@ do_plus_role_logout(const shptr<Implementation>& impl, ::poseidon::Abstract_Fibe
 
     do_role_logout_common(impl, fiber, username);
 
+    // Send the new role list, so the user may select another role.
+    if(auto session = impl->connections.at(username).weak_session.lock())
+      do_send_role_list(session, impl->connections.mut(username));
+
     response.try_emplace(&"status", &"sc_ok");
   }
 
@@ -1307,19 +2343,38 @@ set_http_handler(const phcow_string& path, const http_handler_type& handler)
     if(!this->m_impl)
       this->m_impl = new_sh<X_Implementation>();
 
+    // Discard responses from the old handler.
+    do_purge_http_cache(this->m_impl, path);
     return this->m_impl->http_handlers.insert_or_assign(path, handler).second;
   }
 
 bool
 User_Service::
-remove_http_handler(const phcow_string& path) noexcept
+remove_http_handler(const phcow_string& path)
   {
     if(!this->m_impl)
       return false;
 
+    do_purge_http_cache(this->m_impl, path);
     return this->m_impl->http_handlers.erase(path);
   }
 
+void
+User_Service::
+set_http_cache_ttl(const phcow_string& path, seconds ttl)
+  {
+    if(!this->m_impl)
+      this->m_impl = new_sh<X_Implementation>();
+
+    if(ttl <= 0s)
+      this->m_impl->http_cache_ttls.erase(path);
+    else
+      this->m_impl->http_cache_ttls.insert_or_assign(path, ttl);
+
+    // Discard responses that have been cached with the old TTL.
+    do_purge_http_cache(this->m_impl, path);
+  }
+
 void
 User_Service::
 add_ws_authenticator(const phcow_string& path, const ws_authenticator_type& handler)
@@ -1369,6 +2424,8 @@ set_ws_handler(const phcow_string& opcode, const ws_handler_type& handler)
     if(!this->m_impl)
       this->m_impl = new_sh<X_Implementation>();
 
+    this->m_impl->opaque_relay_opcodes.erase(opcode);
+    this->m_impl->relay_routes.erase(opcode);
     return this->m_impl->ws_handlers.insert_or_assign(opcode, handler).second;
   }
 
@@ -1379,6 +2436,8 @@ remove_ws_handler(const phcow_string& opcode) noexcept
     if(!this->m_impl)
       return false;
 
+    this->m_impl->opaque_relay_opcodes.erase(opcode);
+    this->m_impl->relay_routes.erase(opcode);
     return this->m_impl->ws_handlers.erase(opcode);
   }
 
@@ -1445,14 +2504,20 @@ reload(const ::poseidon::Config_File& conf_file)
           "[in configuration file '$2']"),
           nickname_length_limits_0, conf_file.path(), nickname_length_limits_1);
 
+    // `agent.max_concurrent_logins`
+    uint16_t max_concurrent_logins = static_cast<uint16_t>(conf_file.get_integer_opt(
+                                    &"agent.max_concurrent_logins", 1, 65535).value_or(50));
+
     // Set up new configuration. This operation shall be atomic.
     this->m_impl->redis_role_ttl = redis_role_ttl;
     this->m_impl->client_port = client_port;
     this->m_impl->client_rate_limit = client_rate_limit;
     this->m_impl->client_ping_interval = client_ping_interval;
+    do_resize_ping_wheel(this->m_impl, static_cast<size_t>(client_ping_interval / ping_wheel_tick));
     this->m_impl->max_number_of_roles_per_user = max_number_of_roles_per_user;
     this->m_impl->nickname_length_limits[0] = nickname_length_limits_0;
     this->m_impl->nickname_length_limits[1] = nickname_length_limits_1;
+    this->m_impl->max_concurrent_logins = max_concurrent_logins;
 
     // Set up builtin handlers.
     this->m_impl->ws_handlers.insert_or_assign(&"+role/create", bindw(this->m_impl, do_plus_role_create));
@@ -1469,12 +2534,19 @@ reload(const ::poseidon::Config_File& conf_file)
     service.set_handler(&"*user/reload_relay_conf", bindw(this->m_impl, do_star_user_reload_relay_conf));
     service.set_handler(&"*user/ban/set", bindw(this->m_impl, do_star_user_ban_set));
     service.set_handler(&"*user/ban/lift", bindw(this->m_impl, do_star_user_ban_lift));
+    service.set_handler(&"*channel/join", bindw(this->m_impl, do_star_channel_join));
+    service.set_handler(&"*channel/leave", bindw(this->m_impl, do_star_channel_leave));
+    service.set_handler(&"*channel/push_message", bindw(this->m_impl, do_star_channel_push_message));
     service.set_handler(&"*nickname/acquire", bindw(this->m_impl, do_star_nickname_acquire));
     service.set_handler(&"*nickname/release", bindw(this->m_impl, do_star_nickname_release));
 
     // Restart the service.
     this->m_impl->ping_timer.start(150ms, 7001ms, bindw(this->m_impl, do_ping_timer_callback));
-    this->m_impl->check_user_timer.start(2min, bindw(this->m_impl, do_check_user_timer_callback));
+    this->m_impl->ping_wheel_timer.start(ping_wheel_tick, bindw(this->m_impl, do_ping_wheel_timer_callback));
+    this->m_impl->check_user_timer.start(check_user_interval, bindw(this->m_impl, do_check_user_timer_callback));
+    this->m_impl->login_queue_timer.start(3s, bindw(this->m_impl, do_login_queue_timer_callback));
+    this->m_impl->logout_flush_timer.start(logout_flush_interval, bindw(this->m_impl, do_logout_flush_timer_callback));
+    this->m_impl->nickname_sync_timer.start(1s, 7001ms, bindw(this->m_impl, do_nickname_sync_timer_callback));
     this->m_impl->user_server.start(this->m_impl->client_port, bindw(this->m_impl, do_server_hws_callback));
   }
 
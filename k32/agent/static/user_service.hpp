@@ -44,7 +44,16 @@ class User_Service
 
     // Removes an HTTP handler for requests from users.
     bool
-    remove_http_handler(const phcow_string& path) noexcept;
+    remove_http_handler(const phcow_string& path);
+
+    // Sets how long responses from the HTTP handler for `path` may be cached.
+    // Responses are cached separately for each query string, and are served
+    // without calling the handler until they expire. The number of cached
+    // responses is bounded, and responses that expire soonest are evicted
+    // first. Cached responses for `path` are discarded when its handler is set
+    // or removed. If `ttl` is zero, caching is disabled, which is the default.
+    void
+    set_http_cache_ttl(const phcow_string& path, seconds ttl);
 
     // This callback is invoked when a WebSocket connection is established from
     // a client. `request_raw_query` is the query string in the request URI.
@@ -0,0 +1,100 @@
+// This file is part of k32.
+// Copyright (C) 2024-2025, LH_Mouse. All wrongs reserved.
+
+#include "../../xprecompiled.hpp"
+#include "blob_codec.hpp"
+#include <zlib.h>
+namespace k32 {
+namespace {
+
+// The header consists of `\xFF`, the codec, and the size of the original blob
+// as a 32-bit little-endian integer. `\xFF` is invalid in UTF-8.
+constexpr size_t header_size = 6;
+constexpr size_t min_compress_size = 256;
+
+}  // namespace
+
+Blob_Codec
+parse_blob_codec(const cow_string& name)
+  {
+    if(name == "none")
+      return blob_codec_none;
+    else if(name == "zlib")
+      return blob_codec_zlib;
+    else
+      POSEIDON_THROW(("Unknown blob codec `$1`"), name);
+  }
+
+cow_string
+blob_compress(const cow_string& data, Blob_Codec codec)
+  {
+    if((codec == blob_codec_none) || (data.size() < min_compress_size) || (data.size() > UINT32_MAX))
+      return data;
+
+    cow_string out;
+    out.append(header_size, '\xFF');
+    out.mut(1) = static_cast<char>(codec);
+    for(size_t k = 0;  k != 4;  ++k)
+      out.mut(2 + k) = static_cast<char>(data.size() >> k * 8);
+
+    switch(codec)
+      {
+      case blob_codec_zlib:
+        {
+          ::uLongf out_len = ::compressBound(static_cast<::uLong>(data.size()));
+          out.append(out_len, '\0');
+          int err = ::compress2(reinterpret_cast<::Bytef*>(out.mut_data() + header_size), &out_len,
+                                reinterpret_cast<const ::Bytef*>(data.data()),
+                                static_cast<::uLong>(data.size()), Z_DEFAULT_COMPRESSION);
+          if(err != Z_OK)
+            POSEIDON_THROW(("Could not compress blob: zlib error $1"), err);
+
+          out.erase(header_size + out_len);
+          break;
+        }
+
+      case blob_codec_none:
+      default:
+        POSEIDON_THROW(("Unknown blob codec `$1`"), static_cast<int>(codec));
+      }
+
+    // Store the original blob if it can't be compressed.
+    if(out.size() >= data.size())
+      return data;
+
+    return out;
+  }
+
+cow_string
+blob_decompress(const cow_string& data)
+  {
+    if((data.size() < header_size) || (data[0] != '\xFF'))
+      return data;
+
+    size_t size = 0;
+    for(size_t k = 0;  k != 4;  ++k)
+      size |= static_cast<size_t>(static_cast<unsigned char>(data[2 + k])) << k * 8;
+
+    cow_string out;
+    switch(static_cast<uint8_t>(data[1]))
+      {
+      case blob_codec_zlib:
+        {
+          out.append(size, '\0');
+          ::uLongf out_len = static_cast<::uLongf>(size);
+          int err = ::uncompress(reinterpret_cast<::Bytef*>(out.mut_data()), &out_len,
+                                 reinterpret_cast<const ::Bytef*>(data.data() + header_size),
+                                 static_cast<::uLong>(data.size() - header_size));
+          if((err != Z_OK) || (out_len != size))
+            POSEIDON_THROW(("Could not decompress blob: zlib error $1"), err);
+          break;
+        }
+
+      default:
+        POSEIDON_THROW(("Unknown blob codec `$1`"), static_cast<int>(data[1]));
+      }
+
+    return out;
+  }
+
+}  // namespace k32
@@ -0,0 +1,34 @@
+// This file is part of k32.
+// Copyright (C) 2024-2025, LH_Mouse. All wrongs reserved.
+
+#ifndef K32_COMMON_DATA_BLOB_CODEC_
+#define K32_COMMON_DATA_BLOB_CODEC_
+
+#include "../../fwd.hpp"
+namespace k32 {
+
+enum Blob_Codec : uint8_t
+  {
+    blob_codec_none  = 0,
+    blob_codec_zlib  = 'z',
+  };
+
+// Parses the name of a codec, which is either `none` or `zlib`. If the name is
+// unknown, an exception is thrown.
+Blob_Codec
+parse_blob_codec(const cow_string& name);
+
+// Compresses a blob for storage. A compressed blob starts with a magic header,
+// which can't occur in text. If `codec` is `blob_codec_none`, or if the blob is
+// too short to benefit from compression, it is returned intact.
+cow_string
+blob_compress(const cow_string& data, Blob_Codec codec);
+
+// Decompresses a blob that has been returned by `blob_compress()`. A blob
+// without a magic header is returned intact, so existing data needn't be
+// converted. If the blob is corrupted, an exception is thrown.
+cow_string
+blob_decompress(const cow_string& data);
+
+}  // namespace k32
+#endif
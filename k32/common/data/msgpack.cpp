@@ -0,0 +1,430 @@
+// This file is part of k32.
+// Copyright (C) 2024-2025, LH_Mouse. All wrongs reserved.
+
+#include "../../xprecompiled.hpp"
+#include "msgpack.hpp"
+namespace k32 {
+namespace {
+
+constexpr uint32_t max_nesting_depth = 32;
+
+void
+do_put_be(cow_string& out, uint64_t value, size_t width)
+  {
+    for(size_t k = width;  k != 0;  --k)
+      out.push_back(static_cast<char>(value >> (k - 1) * 8));
+  }
+
+void
+do_put_header(cow_string& out, size_t len, uint32_t fix_code, size_t fix_max, uint32_t code8,
+              uint32_t code16, uint32_t code32)
+  {
+    // Codes that don't exist are zeroes.
+    if((fix_code != 0) && (len <= fix_max))
+      out.push_back(static_cast<char>(fix_code | len));
+    else if((code8 != 0) && (len <= UINT8_MAX)) {
+      out.push_back(static_cast<char>(code8));
+      do_put_be(out, len, 1);
+    }
+    else if(len <= UINT16_MAX) {
+      out.push_back(static_cast<char>(code16));
+      do_put_be(out, len, 2);
+    }
+    else {
+      POSEIDON_CHECK(len <= UINT32_MAX);
+      out.push_back(static_cast<char>(code32));
+      do_put_be(out, len, 4);
+    }
+  }
+
+void
+do_put_string(cow_string& out, const char* str, size_t len)
+  {
+    do_put_header(out, len, 0xA0, 31, 0xD9, 0xDA, 0xDB);
+    out.append(str, len);
+  }
+
+void
+do_put_integer(cow_string& out, int64_t value)
+  {
+    if((value >= -32) && (value <= 127))
+      out.push_back(static_cast<char>(value));
+    else if((value >= 0) && (value <= UINT8_MAX)) {
+      out.push_back(static_cast<char>(0xCC));
+      do_put_be(out, static_cast<uint64_t>(value), 1);
+    }
+    else if((value >= INT8_MIN) && (value <= INT8_MAX)) {
+      out.push_back(static_cast<char>(0xD0));
+      do_put_be(out, static_cast<uint64_t>(value), 1);
+    }
+    else if((value >= INT16_MIN) && (value <= INT16_MAX)) {
+      out.push_back(static_cast<char>(0xD1));
+      do_put_be(out, static_cast<uint64_t>(value), 2);
+    }
+    else if((value >= INT32_MIN) && (value <= INT32_MAX)) {
+      out.push_back(static_cast<char>(0xD2));
+      do_put_be(out, static_cast<uint64_t>(value), 4);
+    }
+    else {
+      out.push_back(static_cast<char>(0xD3));
+      do_put_be(out, static_cast<uint64_t>(value), 8);
+    }
+  }
+
+void
+do_encode(cow_string& out, const ::taxon::Value& value)
+  {
+    if(value.is_null())
+      out.push_back(static_cast<char>(0xC0));
+    else if(value.is_boolean())
+      out.push_back(static_cast<char>(value.as_boolean() ? 0xC3 : 0xC2));
+    else if(value.is_integer())
+      do_put_integer(out, value.as_integer());
+    else if(value.is_number()) {
+      double num = value.as_number();
+      uint64_t bits;
+      ::memcpy(&bits, &num, 8);
+      out.push_back(static_cast<char>(0xCB));
+      do_put_be(out, bits, 8);
+    }
+    else if(value.is_string()) {
+      const auto& str = value.as_string();
+      do_put_string(out, str.data(), str.size());
+    }
+    else if(value.is_binary()) {
+      const auto& bin = value.as_binary();
+      do_put_header(out, bin.size(), 0, 0, 0xC4, 0xC5, 0xC6);
+      out.append(reinterpret_cast<const char*>(bin.data()), bin.size());
+    }
+    else if(value.is_time()) {
+      // timestamp 96: nanoseconds, then seconds. Seconds are split off first,
+      // so extreme times can't overflow.
+      auto since_epoch = value.as_time().time_since_epoch();
+      auto whole_secs = duration_cast<seconds>(since_epoch);
+      int64_t secs = whole_secs.count();
+      int64_t ns = duration_cast<nanoseconds>(since_epoch - whole_secs).count();
+      if(ns < 0) {
+        secs --;
+        ns += 1000000000;
+      }
+
+      out.push_back(static_cast<char>(0xC7));
+      out.push_back(12);
+      out.push_back(static_cast<char>(0xFF));
+      do_put_be(out, static_cast<uint64_t>(ns), 4);
+      do_put_be(out, static_cast<uint64_t>(secs), 8);
+    }
+    else if(value.is_array()) {
+      const auto& arr = value.as_array();
+      do_put_header(out, arr.size(), 0x90, 15, 0, 0xDC, 0xDD);
+      for(const auto& r : arr)
+        do_encode(out, r);
+    }
+    else {
+      const auto& obj = value.as_object();
+      do_put_header(out, obj.size(), 0x80, 15, 0, 0xDE, 0xDF);
+      for(const auto& r : obj) {
+        do_put_string(out, r.first.data(), r.first.length());
+        do_encode(out, r.second);
+      }
+    }
+  }
+
+bool
+do_get_be(uint64_t& value, const char*& bp, const char* ep, size_t width)
+  {
+    if(static_cast<size_t>(ep - bp) < width)
+      return false;
+
+    value = 0;
+    for(size_t k = 0;  k != width;  ++k)
+      value = value << 8 | static_cast<unsigned char>(*(bp ++));
+
+    return true;
+  }
+
+bool
+do_get_bytes(const char*& data, const char*& bp, const char* ep, uint64_t len)
+  {
+    if(static_cast<uint64_t>(ep - bp) < len)
+      return false;
+
+    data = bp;
+    bp += len;
+    return true;
+  }
+
+bool
+do_decode_timestamp(::taxon::Value& value, const char*& bp, const char* ep, uint64_t len)
+  {
+    uint64_t secs, ns = 0;
+    if(len == 4) {
+      if(!do_get_be(secs, bp, ep, 4))
+        return false;
+    }
+    else if(len == 8) {
+      if(!do_get_be(secs, bp, ep, 8))
+        return false;
+
+      ns = secs >> 34;
+      secs &= 0x3FFFFFFFF;
+    }
+    else if(len == 12) {
+      if(!do_get_be(ns, bp, ep, 4) || !do_get_be(secs, bp, ep, 8))
+        return false;
+    }
+    else
+      return false;
+
+    if(ns >= 1000000000)
+      return false;
+
+    // Reject times that can't be represented in nanoseconds, which would
+    // otherwise overflow. Seconds of timestamp 96 are signed.
+    constexpr int64_t max_secs = duration_cast<seconds>(nanoseconds::max()).count() - 1;
+    int64_t ssecs = static_cast<int64_t>(secs);
+    if((ssecs < -max_secs) || (ssecs > max_secs))
+      return false;
+
+    value = system_time(duration_cast<system_time::duration>(
+                  seconds(ssecs) + nanoseconds(static_cast<int64_t>(ns))));
+    return true;
+  }
+
+bool
+do_decode(::taxon::Value& value, const char*& bp, const char* ep, uint32_t depth);
+
+bool
+do_decode_array(::taxon::Value& value, const char*& bp, const char* ep, uint64_t count,
+                uint32_t depth)
+  {
+    // Each element takes at least one byte.
+    if((depth >= max_nesting_depth) || (static_cast<uint64_t>(ep - bp) < count))
+      return false;
+
+    ::taxon::V_array arr;
+    arr.reserve(static_cast<size_t>(count));
+    while(arr.size() != count)
+      if(!do_decode(arr.emplace_back(), bp, ep, depth + 1))
+        return false;
+
+    value = move(arr);
+    return true;
+  }
+
+bool
+do_decode_map(::taxon::Value& value, const char*& bp, const char* ep, uint64_t count,
+              uint32_t depth)
+  {
+    // Each pair takes at least two bytes.
+    if((depth >= max_nesting_depth) || (static_cast<uint64_t>(ep - bp) / 2 < count))
+      return false;
+
+    ::taxon::V_object obj;
+    ::taxon::Value key;
+    for(uint64_t k = 0;  k != count;  ++k) {
+      if(!do_decode(key, bp, ep, depth + 1) || !key.is_string())
+        return false;
+
+      if(!do_decode(obj.open(key.as_string()), bp, ep, depth + 1))
+        return false;
+    }
+
+    value = move(obj);
+    return true;
+  }
+
+bool
+do_decode(::taxon::Value& value, const char*& bp, const char* ep, uint32_t depth)
+  {
+    if(bp == ep)
+      return false;
+
+    uint32_t code = static_cast<unsigned char>(*(bp ++));
+    uint64_t len;
+    const char* data;
+
+    if(code <= 0x7F) {
+      value = static_cast<int64_t>(code);
+      return true;
+    }
+
+    if(code >= 0xE0) {
+      value = static_cast<int64_t>(static_cast<int8_t>(code));
+      return true;
+    }
+
+    if((code & 0xF0) == 0x80)
+      return do_decode_map(value, bp, ep, code & 0x0F, depth);
+
+    if((code & 0xF0) == 0x90)
+      return do_decode_array(value, bp, ep, code & 0x0F, depth);
+
+    if((code & 0xE0) == 0xA0) {
+      if(!do_get_bytes(data, bp, ep, code & 0x1F))
+        return false;
+
+      value = cow_string(data, code & 0x1F);
+      return true;
+    }
+
+    switch(code)
+      {
+      case 0xC0:
+        value.clear();
+        return true;
+
+      case 0xC2:
+      case 0xC3:
+        value = code == 0xC3;
+        return true;
+
+      case 0xC4:
+      case 0xC5:
+      case 0xC6:
+        // bin 8, bin 16, bin 32
+        if(!do_get_be(len, bp, ep, 1U << (code - 0xC4)) || !do_get_bytes(data, bp, ep, len))
+          return false;
+
+        value = ::taxon::V_binary(reinterpret_cast<const unsigned char*>(data), static_cast<size_t>(len));
+        return true;
+
+      case 0xC7:
+      case 0xC8:
+      case 0xC9:
+        // ext 8, ext 16, ext 32
+        if(!do_get_be(len, bp, ep, 1U << (code - 0xC7)) || (bp == ep) || (static_cast<unsigned char>(*(bp ++)) != 0xFF))
+          return false;
+
+        return do_decode_timestamp(value, bp, ep, len);
+
+      case 0xCA:
+        {
+          // float 32
+          uint64_t bits;
+          if(!do_get_be(bits, bp, ep, 4))
+            return false;
+
+          uint32_t bits32 = static_cast<uint32_t>(bits);
+          float num;
+          ::memcpy(&num, &bits32, 4);
+          value = static_cast<double>(num);
+          return true;
+        }
+
+      case 0xCB:
+        {
+          // float 64
+          uint64_t bits;
+          if(!do_get_be(bits, bp, ep, 8))
+            return false;
+
+          double num;
+          ::memcpy(&num, &bits, 8);
+          value = num;
+          return true;
+        }
+
+      case 0xCC:
+      case 0xCD:
+      case 0xCE:
+      case 0xCF:
+        // uint 8, uint 16, uint 32, uint 64
+        if(!do_get_be(len, bp, ep, 1U << (code - 0xCC)))
+          return false;
+
+        if(len <= INT64_MAX)
+          value = static_cast<int64_t>(len);
+        else
+          value = static_cast<double>(len);
+        return true;
+
+      case 0xD0:
+      case 0xD1:
+      case 0xD2:
+      case 0xD3:
+        {
+          // int 8, int 16, int 32, int 64; sign-extend
+          uint32_t width = 1U << (code - 0xD0);
+          if(!do_get_be(len, bp, ep, width))
+            return false;
+
+          uint32_t shift = 64 - width * 8;
+          value = static_cast<int64_t>(len << shift) >> shift;
+          return true;
+        }
+
+      case 0xD4:
+      case 0xD5:
+      case 0xD6:
+      case 0xD7:
+      case 0xD8:
+        // fixext 1, 2, 4, 8, 16
+        if((bp == ep) || (static_cast<unsigned char>(*(bp ++)) != 0xFF))
+          return false;
+
+        return do_decode_timestamp(value, bp, ep, 1U << (code - 0xD4));
+
+      case 0xD9:
+      case 0xDA:
+      case 0xDB:
+        // str 8, str 16, str 32
+        if(!do_get_be(len, bp, ep, 1U << (code - 0xD9)) || !do_get_bytes(data, bp, ep, len))
+          return false;
+
+        value = cow_string(data, static_cast<size_t>(len));
+        return true;
+
+      case 0xDC:
+      case 0xDD:
+        // array 16, array 32
+        if(!do_get_be(len, bp, ep, 2U << (code - 0xDC)))
+          return false;
+
+        return do_decode_array(value, bp, ep, len, depth);
+
+      case 0xDE:
+      case 0xDF:
+        // map 16, map 32
+        if(!do_get_be(len, bp, ep, 2U << (code - 0xDE)))
+          return false;
+
+        return do_decode_map(value, bp, ep, len, depth);
+
+      default:
+        return false;
+      }
+  }
+
+}  // namespace
+
+void
+msgpack_encode(cow_string& out, const ::taxon::Value& value)
+  {
+    do_encode(out, value);
+  }
+
+void
+msgpack_encode_array_header(cow_string& out, size_t count)
+  {
+    do_put_header(out, count, 0x90, 15, 0, 0xDC, 0xDD);
+  }
+
+void
+msgpack_encode_map_header(cow_string& out, size_t count)
+  {
+    do_put_header(out, count, 0x80, 15, 0, 0xDE, 0xDF);
+  }
+
+bool
+msgpack_decode(::taxon::Value& value, const char* str, size_t len)
+  {
+    const char* bp = str;
+    if(!do_decode(value, bp, str + len, 0))
+      return false;
+
+    // Reject trailing garbage.
+    return bp == str + len;
+  }
+
+}  // namespace k32
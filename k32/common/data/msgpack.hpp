@@ -0,0 +1,31 @@
+// This file is part of k32.
+// Copyright (C) 2024-2025, LH_Mouse. All wrongs reserved.
+
+#ifndef K32_COMMON_DATA_MSGPACK_
+#define K32_COMMON_DATA_MSGPACK_
+
+#include "../../fwd.hpp"
+namespace k32 {
+
+// Encodes a value in MessagePack, and appends it to `out`. Integers are encoded
+// in their shortest forms. Times are encoded as timestamp extensions (type -1).
+void
+msgpack_encode(cow_string& out, const ::taxon::Value& value);
+
+// Encodes the header of an array or a map. It shall be followed by `count`
+// elements or `count` pairs of keys and values, respectively. These allow a
+// message to be assembled from values that have been encoded in advance.
+void
+msgpack_encode_array_header(cow_string& out, size_t count);
+
+void
+msgpack_encode_map_header(cow_string& out, size_t count);
+
+// Decodes a value in MessagePack. If `str` does not contain exactly one valid
+// value, or if nesting is too deep, `false` is returned. Keys of maps must be
+// strings. Extensions other than timestamps are not supported.
+bool
+msgpack_decode(::taxon::Value& value, const char* str, size_t len);
+
+}  // namespace k32
+#endif
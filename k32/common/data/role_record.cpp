@@ -5,6 +5,65 @@
 #define K32_FRIENDS_3543B0B1_DC5A_4F34_B9BB_CAE513821771_
 #include "role_record.hpp"
 namespace k32 {
+namespace {
+
+// A record in the binary format starts with `\xFF`, which can't start a JSON
+// text, followed by a version byte. Integers are little-endian. Strings are
+// prefixed by their lengths as 32-bit integers, and are stored as is, without
+// escaping.
+constexpr char binary_magic = '\xFF';
+constexpr char binary_version = 1;
+
+void
+do_put_le(cow_string& out, uint64_t value, size_t width)
+  {
+    for(size_t k = 0;  k != width;  ++k)
+      out.push_back(static_cast<char>(value >> k * 8));
+  }
+
+void
+do_put_string(cow_string& out, const cow_string& str)
+  {
+    POSEIDON_CHECK(str.size() <= UINT32_MAX);
+    do_put_le(out, str.size(), 4);
+    out.append(str);
+  }
+
+uint64_t
+do_get_le(const cow_string& str, size_t& offset, size_t width)
+  {
+    POSEIDON_CHECK(str.size() - offset >= width);
+    uint64_t value = 0;
+    for(size_t k = 0;  k != width;  ++k)
+      value |= static_cast<uint64_t>(static_cast<unsigned char>(str[offset + k])) << k * 8;
+    offset += width;
+    return value;
+  }
+
+cow_string
+do_get_string(const cow_string& str, size_t& offset)
+  {
+    size_t len = static_cast<size_t>(do_get_le(str, offset, 4));
+    POSEIDON_CHECK(str.size() - offset >= len);
+    cow_string value(str, offset, len);
+    offset += len;
+    return value;
+  }
+
+void
+do_put_header(cow_string& out, const Role_Record& roinfo)
+  {
+    out.push_back(binary_magic);
+    out.push_back(binary_version);
+    do_put_le(out, static_cast<uint64_t>(roinfo.roid), 8);
+    int64_t ns = duration_cast<nanoseconds>(roinfo.update_time.time_since_epoch()).count();
+    do_put_le(out, static_cast<uint64_t>(ns), 8);
+    do_put_le(out, static_cast<uint32_t>(roinfo._home_zone), 4);
+    do_put_string(out, roinfo.username.rdstr());
+    do_put_string(out, roinfo.nickname);
+  }
+
+}  // namespace
 
 const Role_Record Role_Record::null;
 
@@ -17,6 +76,26 @@ void
 Role_Record::
 parse_from_string(const cow_string& str)
   {
+    if((str.size() >= 2) && (str[0] == binary_magic)) {
+      POSEIDON_CHECK(str[1] == binary_version);
+      size_t offset = 2;
+
+      this->roid = static_cast<int64_t>(do_get_le(str, offset, 8));
+      int64_t ns = static_cast<int64_t>(do_get_le(str, offset, 8));
+      this->update_time = system_time(duration_cast<system_time::duration>(nanoseconds(ns)));
+      this->_home_zone = static_cast<int>(static_cast<int32_t>(do_get_le(str, offset, 4)));
+      this->username = do_get_string(str, offset);
+      this->nickname = do_get_string(str, offset);
+      this->avatar = do_get_string(str, offset);
+      this->profile = do_get_string(str, offset);
+      this->whole = do_get_string(str, offset);
+      this->_home_host = do_get_string(str, offset);
+      this->_home_db = do_get_string(str, offset);
+      POSEIDON_CHECK(offset == str.size());
+      return;
+    }
+
+    // This is the old format, which is still accepted.
     ::taxon::Value temp_value;
     POSEIDON_CHECK(temp_value.parse(str));
     ::taxon::V_object root = temp_value.as_object();
@@ -39,21 +118,53 @@ cow_string
 Role_Record::
 serialize_to_string() const
   {
-    ::taxon::V_object root;
+    cow_string str;
+    str.reserve(64 + this->username.size() + this->nickname.size() + this->avatar.size()
+                + this->profile.size() + this->whole.size() + this->_home_host.size()
+                + this->_home_db.size());
+
+    do_put_header(str, *this);
+    do_put_string(str, this->avatar);
+    do_put_string(str, this->profile);
+    do_put_string(str, this->whole);
+    do_put_string(str, this->_home_host);
+    do_put_string(str, this->_home_db);
+    return str;
+  }
 
-    root.try_emplace(&"roid", this->roid);
-    root.try_emplace(&"username", this->username.rdstr());
-    root.try_emplace(&"nickname", this->nickname);
-    root.try_emplace(&"update_time", this->update_time);
-    root.try_emplace(&"avatar", this->avatar);  // JSON as string
-    root.try_emplace(&"profile", this->profile);  // JSON as string
-    root.try_emplace(&"whole", this->whole);  // JSON as string
+cow_string
+Role_Record::
+serialize_meta_to_string() const
+  {
+    cow_string str;
+    str.reserve(64 + this->username.size() + this->nickname.size() + this->_home_host.size()
+                + this->_home_db.size());
+
+    do_put_header(str, *this);
+    do_put_string(str, cow_string());
+    do_put_string(str, cow_string());
+    do_put_string(str, cow_string());
+    do_put_string(str, this->_home_host);
+    do_put_string(str, this->_home_db);
+    return str;
+  }
+
+void
+Role_Record::
+parse_from_redis_value(const ::poseidon::Redis_Value& value)
+  {
+    if(!value.is_array()) {
+      this->parse_from_string(value.as_string());
+      return;
+    }
 
-    root.try_emplace(&"@home_host", this->_home_host);
-    root.try_emplace(&"@home_db", this->_home_db);
-    root.try_emplace(&"@home_zone", static_cast<int64_t>(this->_home_zone));
+    const auto& fields = value.as_array();
+    this->parse_from_string(fields.at(0).as_string());
 
-    return ::taxon::Value(root).to_string();
+    cow_string* const blobs[] = { &(this->avatar), &(this->profile), &(this->whole) };
+    for(size_t k = 0;  (k < 3) && (k + 1 < fields.size());  ++k)
+      if(!fields.at(k + 1).is_nil())
+        *(blobs[k]) = fields.at(k + 1).as_string();
   }
 
 }  // namespace k32
@@ -5,6 +5,7 @@
 #define K32_COMMON_DATA_ROLE_RECORD_
 
 #include "../../fwd.hpp"
+#include <poseidon/redis/redis_value.hpp>
 namespace k32 {
 
 struct Role_Record
@@ -38,6 +39,20 @@ struct Role_Record
 
     cow_string
     serialize_to_string() const;
+
+    // When a role is stored as a Redis hash, `avatar`, `profile` and `whole`
+    // are stored in fields of their own, and all the others are stored in a
+    // `meta` field, which is returned by this function. `parse_from_string()`
+    // accepts it, leaving those three fields empty.
+    cow_string
+    serialize_meta_to_string() const;
+
+    // Parses a role that has been fetched from Redis. If the role is stored
+    // as a string, `value` is that string. If it is stored as a hash, `value`
+    // is an array of its fields `meta`, `avatar`, `profile` and `whole`, in
+    // this order; trailing fields may be omitted.
+    void
+    parse_from_redis_value(const ::poseidon::Redis_Value& value);
   };
 
 }  // namespace k32
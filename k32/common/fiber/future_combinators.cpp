@@ -0,0 +1,99 @@
+// This file is part of k32.
+// Copyright (C) 2024-2025, LH_Mouse. All wrongs reserved.
+
+#include "../../xprecompiled.hpp"
+#include "future_combinators.hpp"
+#include <poseidon/static/fiber_scheduler.hpp>
+namespace k32 {
+namespace {
+
+struct Any_Future final : ::poseidon::Abstract_Future
+  {
+    size_t m_pending = 0;
+    size_t m_first_index = SIZE_MAX;
+    bool m_complete = false;
+
+    virtual
+    void
+    do_on_abstract_future_initialize() override
+      {
+      }
+
+    void
+    on_element_complete(size_t index, bool success)
+      {
+        if(this->m_complete)
+          return;
+
+        // Complete upon the first success, or when all have failed.
+        this->m_pending --;
+        if(success)
+          this->m_first_index = index;
+        else if(this->m_pending != 0)
+          return;
+
+        this->m_complete = true;
+        this->do_abstract_future_initialize_once();
+      }
+  };
+
+struct Element_Waiter_Fiber final : ::poseidon::Abstract_Fiber
+  {
+    wkptr<Any_Future> m_weak_any;
+    shptr<::poseidon::Abstract_Future> m_futr;
+    size_t m_index;
+
+    Element_Waiter_Fiber(const shptr<Any_Future>& any, const shptr<::poseidon::Abstract_Future>& futr,
+                         size_t index)
+      :
+        m_weak_any(any), m_futr(futr), m_index(index)
+      {
+      }
+
+    virtual
+    void
+    do_on_abstract_fiber_execute() override
+      {
+        this->yield(this->m_futr);
+
+        const auto any = this->m_weak_any.lock();
+        if(!any)
+          return;
+
+        any->on_element_complete(this->m_index, this->m_futr->successful());
+      }
+  };
+
+}  // namespace
+
+void
+when_all(::poseidon::Abstract_Fiber& fiber,
+         const cow_vector<shptr<::poseidon::Abstract_Future>>& futures)
+  {
+    // As all futures are running, waiting for them one by one takes no more
+    // time than the slowest one.
+    for(const auto& futr : futures)
+      if(futr)
+        fiber.yield(futr);
+  }
+
+size_t
+when_any(::poseidon::Abstract_Fiber& fiber,
+         const cow_vector<shptr<::poseidon::Abstract_Future>>& futures)
+  {
+    auto any = new_sh<Any_Future>();
+    for(size_t k = 0;  k != futures.size();  ++k)
+      if(futures[k]) {
+        auto fiber2 = new_sh<Element_Waiter_Fiber>(any, futures[k], k);
+        ::poseidon::fiber_scheduler.launch(fiber2);
+        any->m_pending ++;
+      }
+
+    if(any->m_pending == 0)
+      return SIZE_MAX;
+
+    fiber.yield(any);
+    return any->m_first_index;
+  }
+
+}  // namespace k32
@@ -0,0 +1,29 @@
+// This file is part of k32.
+// Copyright (C) 2024-2025, LH_Mouse. All wrongs reserved.
+
+#ifndef K32_COMMON_FIBER_FUTURE_COMBINATORS_
+#define K32_COMMON_FIBER_FUTURE_COMBINATORS_
+
+#include "../../fwd.hpp"
+#include <poseidon/fiber/abstract_future.hpp>
+namespace k32 {
+
+// Suspends the calling fiber until all futures in `futures` have completed,
+// either successfully or not. All futures shall have been launched, so they
+// run concurrently. Futures of any type may be mixed, such as `Service_Future`,
+// `HTTP_Future`, `Redis_Query_Future` and `MySQL_Query_Future`. The caller
+// shall check the result of each future afterwards.
+void
+when_all(::poseidon::Abstract_Fiber& fiber,
+         const cow_vector<shptr<::poseidon::Abstract_Future>>& futures);
+
+// Suspends the calling fiber until any future in `futures` has completed
+// successfully, and returns its index. If all futures have failed, or if
+// `futures` is empty, `SIZE_MAX` is returned. Other futures are not cancelled,
+// and may still complete later.
+size_t
+when_any(::poseidon::Abstract_Fiber& fiber,
+         const cow_vector<shptr<::poseidon::Abstract_Future>>& futures);
+
+}  // namespace k32
+#endif
@@ -0,0 +1,33 @@
+// This file is part of k32.
+// Copyright (C) 2024-2025, LH_Mouse. All wrongs reserved.
+
+#ifndef K32_COMMON_TEXT_DISPLAY_WIDTH_
+#define K32_COMMON_TEXT_DISPLAY_WIDTH_
+
+#include "../../fwd.hpp"
+namespace k32 {
+
+// Gets the number of columns that a character takes on screen. East Asian wide
+// and fullwidth characters take two columns, and other printable characters
+// take one. For control characters, combining marks, format characters,
+// surrogates and noncharacters, -1 is returned. Unlike `wcwidth()`, the result
+// does not depend on the current locale.
+int
+unicode_display_width(char32_t cp) noexcept;
+
+// Validates a UTF-8 string, and returns the sum of display widths of all its
+// characters. If the string is not valid UTF-8, or if it contains any character
+// whose width is -1, -1 is returned. Long runs of printable ASCII characters
+// are checked in blocks of 16 bytes.
+int
+utf8_display_width(const char* str, size_t len) noexcept;
+
+inline
+int
+utf8_display_width(const cow_string& str) noexcept
+  {
+    return noadl::utf8_display_width(str.data(), str.size());
+  }
+
+}  // namespace k32
+#endif
@@ -6,15 +6,18 @@
 #include "role_service.hpp"
 #include "../globals.hpp"
 #include "../../common/data/role_record.hpp"
+#include "../../common/data/msgpack.hpp"
 #include <poseidon/base/config_file.hpp>
 #include <poseidon/base/datetime.hpp>
 #include <poseidon/easy/easy_timer.hpp>
 #include <poseidon/fiber/redis_query_future.hpp>
 #include <poseidon/static/task_scheduler.hpp>
-#include <list>
+#include <deque>
 namespace k32::logic {
 namespace {
 
+constexpr seconds save_tick = 1s;
+
 struct Hydrated_Role
   {
     Role_Record roinfo;
@@ -24,7 +27,9 @@ struct Hydrated_Role
 struct Implementation
   {
     seconds redis_role_ttl;
+    bool redis_role_hash;
     seconds disconnect_to_logout_duration;
+    seconds save_interval;
 
     cow_dictionary<Role_Service::handler_type> handlers;
 
@@ -33,7 +38,13 @@ struct Implementation
 
     // online roles
     cow_int64_dictionary<Hydrated_Role> hyd_roles;
-    ::std::list<static_vector<int64_t, 255>> save_buckets;
+
+    // roles to save in the current cycle, which ends at `save_deadline`
+    ::std::deque<int64_t> save_queue;
+    steady_time save_deadline;
+    steady_clock::duration save_cost_per_role = steady_clock::duration::zero();
+    bool save_running = false;
+    bool save_behind_reported = false;
   };
 
 void
@@ -45,7 +56,8 @@ do_set_role_record_common_fields(::taxon::V_object& temp_obj, const shptr<Role>&
   }
 
 void
-do_store_role_into_redis(::poseidon::Abstract_Fiber& fiber, Hydrated_Role& hyd, seconds ttl)
+do_store_role_into_redis(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
+                         Hydrated_Role& hyd, bool online)
   {
     POSEIDON_LOG_DEBUG(("Storing role `$1`: preparing data"), hyd.roinfo.roid);
 
@@ -54,34 +66,113 @@ do_store_role_into_redis(::poseidon::Abstract_Fiber& fiber, Hydrated_Role& hyd,
     hyd.roinfo.nickname = hyd.role->nickname();
     hyd.roinfo.update_time = system_clock::now();
 
+    // `hyd.roinfo` holds what was saved last time, so see which sections have
+    // changed. If roles are stored as hashes, only those are written.
+    cow_vector<cow_string> changed_fields;
     ::taxon::V_object temp_obj;
     hyd.role->make_avatar(temp_obj);
     do_set_role_record_common_fields(temp_obj, hyd.role);
-    hyd.roinfo.avatar = ::taxon::Value(temp_obj).to_string();
+    cow_string str = ::taxon::Value(temp_obj).to_string();
+    if(str != hyd.roinfo.avatar) {
+      changed_fields.emplace_back(&"avatar");
+      changed_fields.emplace_back(str);
+      hyd.roinfo.avatar = move(str);
+    }
 
     temp_obj.clear();
     hyd.role->make_profile(temp_obj);
     do_set_role_record_common_fields(temp_obj, hyd.role);
-    hyd.roinfo.profile = ::taxon::Value(temp_obj).to_string();
+    str = ::taxon::Value(temp_obj).to_string();
+    if(str != hyd.roinfo.profile) {
+      changed_fields.emplace_back(&"profile");
+      changed_fields.emplace_back(str);
+      hyd.roinfo.profile = move(str);
+    }
 
     temp_obj.clear();
     hyd.role->make_db_record(temp_obj);
     do_set_role_record_common_fields(temp_obj, hyd.role);
-    hyd.roinfo.whole = ::taxon::Value(temp_obj).to_string();
+    str = ::taxon::Value(temp_obj).to_string();
+    if(str != hyd.roinfo.whole) {
+      changed_fields.emplace_back(&"whole");
+      changed_fields.emplace_back(str);
+      hyd.roinfo.whole = move(str);
+    }
 
     POSEIDON_LOG_INFO(("#sav# Saving into Redis: role `$1` (`$2`), updated on `$3`"),
                       hyd.roinfo.roid, hyd.roinfo.nickname, hyd.roinfo.update_time);
 
-    cow_vector<cow_string> redis_cmd;
-    redis_cmd.emplace_back(&"SET");
-    redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), hyd.roinfo.roid));
-    redis_cmd.emplace_back(hyd.roinfo.serialize_to_string());
-    redis_cmd.emplace_back(&"EX");
-    redis_cmd.emplace_back(sformat("$1", ttl.count()));
+    // Also update the location of this role, so agents can find it when its
+    // client reconnects. When the role goes offline, its location is deleted,
+    // unless it has been taken over by another logic server. If only some
+    // fields are to be written but the role is not a hash in Redis (it may have
+    // expired, or be in the string layout), nothing is written, and `0` is
+    // returned, so all fields will have to be written again.
+    static constexpr char redis_store_role[] =
+        R"!!!(
+          local kind = redis.call('TYPE', KEYS[1]).ok
+          if ARGV[4] == 'string' then
+            redis.call('SET', KEYS[1], ARGV[5], 'EX', ARGV[1])
+          elseif (kind == 'hash') or (ARGV[4] == 'full') then
+            if kind ~= 'hash' then
+              redis.call('DEL', KEYS[1])
+            end
+            redis.call('HSET', KEYS[1], 'meta', ARGV[5], unpack(ARGV, 6))
+            redis.call('EXPIRE', KEYS[1], ARGV[1])
+          else
+            return 0
+          end
+          if ARGV[3] == '1' then
+            redis.call('SET', KEYS[2], ARGV[2], 'EX', ARGV[1])
+          elseif redis.call('GET', KEYS[2]) == ARGV[2] then
+            redis.call('DEL', KEYS[2])
+          end
+          return 1
+        )!!!";
+
+    bool full = false;
+    for(;;) {
+      cow_vector<cow_string> redis_cmd;
+      redis_cmd.emplace_back(&"EVAL");
+      redis_cmd.emplace_back(&redis_store_role);
+      redis_cmd.emplace_back(&"2");
+      redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), hyd.roinfo.roid));
+      redis_cmd.emplace_back(sformat("$1/role_logic/$2", service.application_name(), hyd.roinfo.roid));
+      redis_cmd.emplace_back(sformat("$1", impl->redis_role_ttl.count()));  // ARGV[1]
+      redis_cmd.emplace_back(service.service_uuid().to_string());  // ARGV[2]
+      redis_cmd.emplace_back(online ? &"1" : &"0");  // ARGV[3]
+
+      if(!impl->redis_role_hash) {
+        redis_cmd.emplace_back(&"string");  // ARGV[4]
+        redis_cmd.emplace_back(hyd.roinfo.serialize_to_string());  // ARGV[5]
+      }
+      else if(full) {
+        redis_cmd.emplace_back(&"full");  // ARGV[4]
+        redis_cmd.emplace_back(hyd.roinfo.serialize_meta_to_string());  // ARGV[5]
+        redis_cmd.emplace_back(&"avatar");
+        redis_cmd.emplace_back(hyd.roinfo.avatar);
+        redis_cmd.emplace_back(&"profile");
+        redis_cmd.emplace_back(hyd.roinfo.profile);
+        redis_cmd.emplace_back(&"whole");
+        redis_cmd.emplace_back(hyd.roinfo.whole);
+      }
+      else {
+        redis_cmd.emplace_back(&"partial");  // ARGV[4]
+        redis_cmd.emplace_back(hyd.roinfo.serialize_meta_to_string());  // ARGV[5]
+        for(const auto& field : changed_fields)
+          redis_cmd.emplace_back(field);
+      }
+
+      auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
+      ::poseidon::task_scheduler.launch(task2);
+      fiber.yield(task2);
+
+      if(task2->result().as_integer() != 0)
+        break;
 
-    auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
-    ::poseidon::task_scheduler.launch(task2);
-    fiber.yield(task2);
+      POSEIDON_LOG_DEBUG(("Role `$1` is not a hash in Redis; writing all fields"), hyd.roinfo.roid);
+      full = true;
+    }
 
     POSEIDON_LOG_INFO(("#sav# Saved into Redis: role `$1` (`$2`), updated on `$3`"),
                       hyd.roinfo.roid, hyd.roinfo.nickname, hyd.roinfo.update_time);
@@ -116,79 +207,118 @@ do_flush_role_to_mysql(::poseidon::Abstract_Fiber& fiber, Hydrated_Role& hyd)
   }
 
 void
-do_save_timer_callback(const shptr<Implementation>& impl,
-                       const shptr<::poseidon::Abstract_Timer>& /*timer*/,
-                       ::poseidon::Abstract_Fiber& fiber, steady_time now)
+do_save_hydrated_role(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
+                      int64_t roid, steady_time now)
   {
-    if(impl->save_buckets.empty()) {
-      // Arrange online roles for writing. Initially, users are divided into 20
-      // buckets. For each timer tick, one bucket will be popped and written.
-      while(impl->save_buckets.size() < 20)
-        impl->save_buckets.emplace_back();
-
-      for(const auto& r : impl->hyd_roles) {
-        auto first_bucket = impl->save_buckets.begin();
-        if(first_bucket->size() >= first_bucket->capacity())
-          first_bucket = impl->save_buckets.emplace(first_bucket);
-
-        first_bucket->push_back(r.first);
-        impl->save_buckets.splice(impl->save_buckets.end(), impl->save_buckets, first_bucket);
-      }
-    }
+    // Serialize role data for saving. As this is an asynchronous operation,
+    // `impl->hyd_roles` may change in the meantime. It's crucial that we limit
+    // scopes of pointers, references, and iterators.
+    Hydrated_Role hyd;
+    impl->hyd_roles.find_and_copy(hyd, roid);
+    if(!hyd.role)
+      return;
 
-    auto bucket = move(impl->save_buckets.back());
-    impl->save_buckets.pop_back();
-    while(!bucket.empty()) {
-      int64_t roid = bucket.back();
-      bucket.pop_back();
+    if(!hyd.role->disconnected()) {
+      // Check client connection with agent.
+      ::taxon::V_object tx_args;
+      tx_args.try_emplace(&"username", hyd.role->username().rdstr());
+      tx_args.try_emplace(&"roid", hyd.role->roid());
 
-      // Serialize role data for saving. As this is an asynchronous operation,
-      // `impl->hyd_roles` may change between iterations. It's crucial that we
-      // limit scopes of pointers, references, and iterators.
-      Hydrated_Role hyd;
-      impl->hyd_roles.find_and_copy(hyd, roid);
-      if(!hyd.role)
-        continue;
+      auto srv_q = new_sh<Service_Future>(hyd.role->agent_service_uuid(), &"*user/check_role", tx_args);
+      service.launch(srv_q);
+      fiber.yield(srv_q);
 
-      if(!hyd.role->disconnected()) {
-        // Check client connection with agent.
-        ::taxon::V_object tx_args;
-        tx_args.try_emplace(&"username", hyd.role->username().rdstr());
-        tx_args.try_emplace(&"roid", hyd.role->roid());
+      if(!impl->hyd_roles.count(roid))
+        return;
 
-        auto srv_q = new_sh<Service_Future>(hyd.role->agent_service_uuid(), &"*user/check_role", tx_args);
-        service.launch(srv_q);
-        fiber.yield(srv_q);
+      cow_string status;
+      if(auto ptr = srv_q->response(0).obj.ptr(&"status"))
+        status = ptr->as_string();
 
-        if(!impl->hyd_roles.count(roid))
-          continue;
+      if(status != "gs_ok") {
+        hyd.role->mf_agent_srv() = ::poseidon::UUID::min();
+        hyd.role->mf_dc_since() = now;
+        hyd.role->on_disconnect();
+      }
+    }
 
-        cow_string status;
-        if(auto ptr = srv_q->response(0).obj.ptr(&"status"))
-          status = ptr->as_string();
+    if(hyd.role->disconnected() && (now - hyd.role->mf_dc_since() >= impl->disconnect_to_logout_duration)) {
+      // Role has been disconnected for too long.
+      POSEIDON_LOG_DEBUG(("Logging out role `$1` due to inactivity"), hyd.roinfo.roid);
+      hyd.role->on_logout();
 
-        if(status != "gs_ok") {
-          hyd.role->mf_agent_srv() = ::poseidon::UUID::min();
-          hyd.role->mf_dc_since() = now;
-          hyd.role->on_disconnect();
-        }
-      }
+      do_store_role_into_redis(impl, fiber, hyd, false);
+      impl->hyd_roles.erase(roid);
+      do_flush_role_to_mysql(fiber, hyd);
+    }
+    else {
+      do_store_role_into_redis(impl, fiber, hyd, true);
+      if(auto ptr = impl->hyd_roles.mut_ptr(roid))
+        *ptr = hyd;
+    }
+  }
 
-      if(hyd.role->disconnected() && (now - hyd.role->mf_dc_since() >= impl->disconnect_to_logout_duration)) {
-        // Role has been disconnected for too long.
-        POSEIDON_LOG_DEBUG(("Logging out role `$1` due to inactivity"), hyd.roinfo.roid);
-        hyd.role->on_logout();
+void
+do_save_timer_callback(const shptr<Implementation>& impl,
+                       const shptr<::poseidon::Abstract_Timer>& /*timer*/,
+                       ::poseidon::Abstract_Fiber& fiber, steady_time now)
+  {
+    if(impl->save_running)
+      return;
 
-        do_store_role_into_redis(fiber, hyd, impl->redis_role_ttl);
-        impl->hyd_roles.erase(roid);
-        do_flush_role_to_mysql(fiber, hyd);
-      }
-      else {
-        do_store_role_into_redis(fiber, hyd, impl->redis_role_ttl);
-        if(auto ptr = impl->hyd_roles.mut_ptr(roid))
-          *ptr = hyd;
+    if(impl->save_queue.empty()) {
+      // Every online role shall be saved once per cycle.
+      for(const auto& r : impl->hyd_roles)
+        impl->save_queue.push_back(r.first);
+
+      impl->save_deadline = now + impl->save_interval;
+      impl->save_behind_reported = false;
+      if(impl->save_queue.empty())
+        return;
+    }
+
+    // Save roles at a steady rate, so that the queue is drained by the end of
+    // this cycle. The rate goes up if earlier ticks have been slow.
+    steady_clock::duration time_left = impl->save_deadline - now;
+    size_t ticks_left = 1;
+    if(time_left > save_tick)
+      ticks_left = static_cast<size_t>(time_left / save_tick);
+
+    size_t quota = (impl->save_queue.size() + ticks_left - 1) / ticks_left;
+
+    auto time_needed = impl->save_cost_per_role * static_cast<int64_t>(impl->save_queue.size());
+    if(!impl->save_behind_reported && (time_needed > time_left)) {
+      POSEIDON_LOG_WARN((
+          "Role saving is falling behind: $1 role(s) left, $2 per role, $3 left",
+          "[consider increasing `logic.save_interval`]"),
+          impl->save_queue.size(), duration_cast<milliseconds>(impl->save_cost_per_role),
+          duration_cast<milliseconds>(time_left));
+      impl->save_behind_reported = true;
+    }
+
+    // Ticks are skipped while a previous one is still running.
+    const steady_time start_time = steady_clock::now();
+    size_t count = 0;
+    impl->save_running = true;
+    try {
+      while((quota != 0) && !impl->save_queue.empty()) {
+        int64_t roid = impl->save_queue.front();
+        impl->save_queue.pop_front();
+        quota --;
+        count ++;
+        do_save_hydrated_role(impl, fiber, roid, now);
       }
     }
+    catch(...) {
+      impl->save_running = false;
+      throw;
+    }
+    impl->save_running = false;
+
+    // Keep track of the average time to save a role, including time spent
+    // waiting for agents and Redis.
+    auto cost = (steady_clock::now() - start_time) / static_cast<int64_t>(count);
+    impl->save_cost_per_role = (impl->save_cost_per_role * 7 + cost) / 8;
   }
 
 void
@@ -210,12 +340,27 @@ do_star_role_login(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber
     Hydrated_Role hyd;
     impl->hyd_roles.find_and_copy(hyd, roid);
     if(!hyd.role) {
-      // Load role from Redis.
+      // Load role from Redis, in either layout.
+      static constexpr char redis_get_role[] =
+          R"!!!(
+            local value
+            if redis.call('TYPE', KEYS[1]).ok == 'hash' then
+              value = redis.call('HMGET', KEYS[1], 'meta', 'avatar', 'profile', 'whole')
+            else
+              value = redis.call('GET', KEYS[1])
+            end
+            if value then
+              redis.call('EXPIRE', KEYS[1], ARGV[1])
+            end
+            return value
+          )!!!";
+
       cow_vector<cow_string> redis_cmd;
-      redis_cmd.emplace_back(&"GETEX");
-      redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roid));
-      redis_cmd.emplace_back(&"EX");
-      redis_cmd.emplace_back(sformat("$1", impl->redis_role_ttl.count()));
+      redis_cmd.emplace_back(&"EVAL");
+      redis_cmd.emplace_back(&redis_get_role);
+      redis_cmd.emplace_back(&"1");   // one key
+      redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roid));  // KEYS[1]
+      redis_cmd.emplace_back(sformat("$1", impl->redis_role_ttl.count()));  // ARGV[1]
 
       auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
       ::poseidon::task_scheduler.launch(task2);
@@ -226,7 +371,7 @@ do_star_role_login(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber
         return;
       }
 
-      hyd.roinfo.parse_from_string(task2->result().as_string());
+      hyd.roinfo.parse_from_redis_value(task2->result());
       hyd.role = new_sh<Role>();
 
       hyd.role->mf_roid() = hyd.roinfo.roid;
@@ -241,8 +386,14 @@ do_star_role_login(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber
       }
 
       auto result = impl->hyd_roles.try_emplace(hyd.roinfo.roid, hyd);
-      if(result.second)
+      if(result.second) {
         hyd.role->on_login();
+
+        // Join the current cycle, so the first save isn't delayed until the
+        // next one. If no cycle is running, the next tick starts one.
+        if(!impl->save_queue.empty())
+          impl->save_queue.push_back(hyd.roinfo.roid);
+      }
       else
         hyd = result.first->second;  // load conflict
     }
@@ -251,6 +402,19 @@ do_star_role_login(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber
     hyd.role->mf_monitor_srv() = monitor_service_uuid;
     hyd.role->on_connect();
 
+    // Publish the location of this role now. It'll be refreshed when the role
+    // is saved.
+    cow_vector<cow_string> redis_cmd;
+    redis_cmd.emplace_back(&"SET");
+    redis_cmd.emplace_back(sformat("$1/role_logic/$2", service.application_name(), roid));
+    redis_cmd.emplace_back(service.service_uuid().to_string());
+    redis_cmd.emplace_back(&"EX");
+    redis_cmd.emplace_back(sformat("$1", impl->redis_role_ttl.count()));
+
+    auto task3 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
+    ::poseidon::task_scheduler.launch(task3);
+    fiber.yield(task3);
+
     response.try_emplace(&"status", &"gs_ok");
   }
 
@@ -279,10 +443,11 @@ do_star_role_logout(const shptr<Implementation>& impl, ::poseidon::Abstract_Fibe
 
     hyd.role->on_logout();
 
-    do_store_role_into_redis(fiber, hyd, impl->redis_role_ttl);
+    do_store_role_into_redis(impl, fiber, hyd, false);
     impl->hyd_roles.erase(roid);
     do_flush_role_to_mysql(fiber, hyd);
 
+    response.try_emplace(&"raw_avatar", hyd.roinfo.avatar);
     response.try_emplace(&"status", &"gs_ok");
   }
 
@@ -357,6 +522,28 @@ do_star_role_on_client_request(const shptr<Implementation>& impl, ::poseidon::Ab
     if(auto ptr = request.ptr(&"client_req"))
       client_req = ptr->as_object();
 
+    // If the request has been relayed as is, it shall be parsed here, and the
+    // response shall be encoded here, so the agent will just send it.
+    bool client_msgpack = false;
+    if(auto ptr = request.ptr(&"client_msgpack"))
+      client_msgpack = ptr->as_boolean();
+
+    bool client_opaque = false;
+    if(auto ptr = request.ptr(&"client_data")) {
+      const auto& client_data = ptr->as_binary();
+      ::taxon::Value temp_value;
+      if(client_msgpack)
+        POSEIDON_CHECK(msgpack_decode(temp_value, reinterpret_cast<const char*>(client_data.data()),
+                                      client_data.size()));
+      else
+        POSEIDON_CHECK(temp_value.parse(cow_string(reinterpret_cast<const char*>(client_data.data()),
+                                                   client_data.size()),
+                                        ::taxon::option_json_mode));
+      client_req = temp_value.as_object();
+      temp_value.clear();
+      client_opaque = true;
+    }
+
     ////////////////////////////////////////////////////////////
     //
     Role_Service::handler_type handler;
@@ -377,7 +564,23 @@ do_star_role_on_client_request(const shptr<Implementation>& impl, ::poseidon::Ab
       return;
     }
 
-    response.try_emplace(&"client_resp", client_resp);
+    if(!client_opaque)
+      response.try_emplace(&"client_resp", client_resp);
+    else if(auto ptr = client_req.ptr(&"%serial")) {
+      client_resp.try_emplace(&"%serial", *ptr);
+      cow_string client_resp_data;
+      if(client_msgpack)
+        msgpack_encode(client_resp_data, ::taxon::Value(client_resp));
+      else {
+        ::rocket::tinybuf_str buf;
+        ::taxon::Value(client_resp).print_to(buf, ::taxon::option_json_mode);
+        client_resp_data = buf.get_string();
+      }
+      response.try_emplace(&"client_resp_data",
+                ::taxon::V_binary(reinterpret_cast<const unsigned char*>(client_resp_data.data()),
+                                  client_resp_data.size()));
+    }
+
     response.try_emplace(&"status", &"gs_ok");
   }
 
@@ -488,13 +691,33 @@ reload(const ::poseidon::Config_File& conf_file)
     seconds redis_role_ttl = seconds(static_cast<int>(conf_file.get_integer_opt(
                                     &"redis_role_ttl", 600, 999999999).value_or(900)));
 
+    // `redis_role_layout`
+    cow_string redis_role_layout = conf_file.get_string_opt(&"redis_role_layout").value_or(&"string");
+    if((redis_role_layout != "string") && (redis_role_layout != "hash"))
+      POSEIDON_THROW(("Invalid `redis_role_layout` `$1`"), redis_role_layout);
+
     // `logic.disconnect_to_logout_duration`
     seconds disconnect_to_logout_duration = seconds(static_cast<int>(conf_file.get_integer_opt(
                                     &"logic.disconnect_to_logout_duration", 1, 999999999).value_or(60)));
 
+    // `logic.save_interval`
+    seconds save_interval = seconds(static_cast<int>(conf_file.get_integer_opt(
+                                    &"logic.save_interval", 5, 3600).value_or(60)));
+
+    // A role may be saved at the beginning of one cycle and at the end of the
+    // next, so two saves can be twice the interval apart. Leave some room for
+    // slow cycles as well; otherwise keys of online roles may expire.
+    if(save_interval * 3 > redis_role_ttl)
+      POSEIDON_THROW((
+          "`logic.save_interval` is too long: $1",
+          "[it shall not exceed a third of `redis_role_ttl` ($2)]"),
+          save_interval, redis_role_ttl);
+
     // Set up new configuration. This operation shall be atomic.
     this->m_impl->redis_role_ttl = redis_role_ttl;
+    this->m_impl->redis_role_hash = redis_role_layout == "hash";
     this->m_impl->disconnect_to_logout_duration = disconnect_to_logout_duration;
+    this->m_impl->save_interval = save_interval;
 
     // Set up request handlers.
     service.set_handler(&"*role/login", bindw(this->m_impl, do_star_role_login));
@@ -505,7 +728,7 @@ reload(const ::poseidon::Config_File& conf_file)
     service.set_handler(&"*clock/set_virtual_offset", bindw(this->m_impl, do_star_clock_set_virtual_offset));
 
     // Restart the service.
-    this->m_impl->save_timer.start(3001ms, bindw(this->m_impl, do_save_timer_callback));
+    this->m_impl->save_timer.start(save_tick, bindw(this->m_impl, do_save_timer_callback));
     this->m_impl->every_second_timer.start(1s, bindw(this->m_impl, do_every_second_timer_callback));
   }
 
@@ -5,33 +5,117 @@
 #define K32_FRIENDS_3543B0B1_DC5A_4F34_B9BB_CAE513821771_
 #include "role_service.hpp"
 #include "../globals.hpp"
+#include "../../common/fiber/future_combinators.hpp"
+#include "../../common/data/blob_codec.hpp"
 #include <poseidon/base/config_file.hpp>
+#include <poseidon/base/abstract_task.hpp>
+#include <poseidon/fiber/abstract_future.hpp>
 #include <poseidon/easy/easy_ws_server.hpp>
 #include <poseidon/easy/easy_timer.hpp>
 #include <poseidon/fiber/mysql_check_table_future.hpp>
 #include <poseidon/fiber/redis_query_future.hpp>
+#include <poseidon/redis/redis_value.hpp>
 #include <poseidon/static/task_scheduler.hpp>
 #include <poseidon/fiber/mysql_query_future.hpp>
 #include <poseidon/mysql/mysql_connection.hpp>
 #include <poseidon/static/mysql_connector.hpp>
-#include <list>
+#include <deque>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
 namespace k32::monitor {
 namespace {
 
 const cow_int64_dictionary<Role_Record> empty_role_record_map;
+constexpr seconds save_tick = 1s;
+constexpr size_t journal_min_compact_size = 16 * 1048576;
 
 struct Implementation
   {
     seconds redis_role_ttl;
+    bool redis_role_hash;
+    seconds save_interval;
+    uint16_t save_batch_size;
+    uint16_t save_concurrency;
+    Blob_Codec blob_codec;
 
     ::poseidon::Easy_Timer save_timer;
 
     // remote data from mysql
     bool db_ready = false;
     cow_int64_dictionary<Role_Record> role_records;
-    ::std::list<static_vector<int64_t, 255>> save_buckets;
+
+    // Roles are saved in cycles. In each cycle, all roles are put into a queue,
+    // which shall be drained before the deadline at a steady rate.
+    ::std::deque<int64_t> save_queue;
+    steady_time save_deadline;
+    steady_clock::duration save_cost_per_role = steady_clock::duration::zero();
+    bool save_running = false;
+    bool save_behind_reported = false;
+
+    // digests of role records in MySQL, so unchanged ones are not written
+    cow_int64_dictionary<uint64_t> stored_digests;
+
+    // If a journal is enabled, snapshots that are read from Redis are appended
+    // to it, and MySQL writes are deferred, as they can be recovered from it.
+    cow_string journal_directory;
+    cow_string journal_path;
+    seconds journal_mysql_interval;
+    ::rocket::unique_posix_fd journal_fd;
+    size_t journal_size = 0;
+    size_t journal_compact_size = 0;
+    cow_int64_dictionary<uint64_t> journaled_digests;
+    cow_int64_dictionary<steady_time> stored_times;
   };
 
+void
+do_forget_role_record(const shptr<Implementation>& impl, int64_t roid)
+  {
+    impl->role_records.erase(roid);
+    impl->stored_digests.erase(roid);
+    impl->journaled_digests.erase(roid);
+    impl->stored_times.erase(roid);
+  }
+
+uint64_t
+do_digest_role_record(const Role_Record& roinfo)
+  {
+    // This is FNV-1a over contents of a role. `update_time` is not included,
+    // because logic updates it whenever a role is saved into Redis, even if
+    // nothing has changed.
+    uint64_t digest = 0xCBF29CE484222325ULL;
+    for(const cow_string* str : { &(roinfo.username.rdstr()), &(roinfo.nickname),
+                                  &(roinfo.avatar), &(roinfo.profile), &(roinfo.whole) }) {
+      for(char ch : *str)
+        digest = (digest ^ static_cast<unsigned char>(ch)) * 0x100000001B3ULL;
+
+      // Separate fields, so moving bytes across them changes the digest.
+      digest = (digest ^ 0xFF) * 0x100000001B3ULL;
+    }
+    return digest;
+  }
+
+system_time
+do_mysql_update_time(const Role_Record& roinfo)
+  {
+    // `update_time` is a DATETIME column, which holds whole seconds. Times
+    // are truncated here, instead of being rounded by MySQL, so they can be
+    // compared with snapshots in the journal at the same precision.
+    return ::std::chrono::floor<seconds>(roinfo.update_time);
+  }
+
+void
+do_mark_role_record_stored(const shptr<Implementation>& impl, int64_t roid, uint64_t digest)
+  {
+    // The role may have been unloaded while it was being written.
+    if(!impl->role_records.count(roid))
+      return;
+
+    impl->stored_digests.insert_or_assign(roid, digest);
+    impl->stored_times.insert_or_assign(roid, steady_clock::now());
+  }
+
 void
 do_mysql_check_table_role(::poseidon::Abstract_Fiber& fiber)
   {
@@ -99,24 +183,104 @@ do_mysql_check_table_role(::poseidon::Abstract_Fiber& fiber)
     POSEIDON_LOG_INFO(("Finished verification of MySQL table `$1`"), table.name);
   }
 
+cow_string
+do_get_role_version_from_redis(const ::poseidon::Redis_Value& value)
+  {
+    // Logic updates `meta` whenever it saves a role, so it identifies the
+    // version of a hash.
+    if(!value.is_array())
+      return value.as_string();
+    else
+      return value.as_array().at(0).as_string();
+  }
+
+shptr<::poseidon::Redis_Query_Future>
+do_fetch_role_records_from_redis(::poseidon::Abstract_Fiber& fiber, const int64_t* roids,
+                                 size_t count, bool avatar_only)
+  {
+    // Fetch roles in either layout with a single command. The result is an
+    // array of roles, in the same order as `roids`.
+    static constexpr char redis_get_roles[] =
+        R"!!!(
+          local result = {}
+          for i, key in ipairs(KEYS) do
+            if redis.call('TYPE', key).ok == 'hash' then
+              result[i] = redis.call('HMGET', key, unpack(ARGV))
+            else
+              result[i] = redis.call('GET', key)
+            end
+          end
+          return result
+        )!!!";
+
+    cow_vector<cow_string> redis_cmd;
+    redis_cmd.emplace_back(&"EVAL");
+    redis_cmd.emplace_back(&redis_get_roles);
+    redis_cmd.emplace_back(sformat("$1", count));
+    for(size_t k = 0;  k < count;  ++k)
+      redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roids[k]));  // KEYS[k+1]
+
+    redis_cmd.emplace_back(&"meta");
+    redis_cmd.emplace_back(&"avatar");
+    if(!avatar_only) {
+      redis_cmd.emplace_back(&"profile");
+      redis_cmd.emplace_back(&"whole");
+    }
+
+    auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
+    ::poseidon::task_scheduler.launch(task2);
+    fiber.yield(task2);
+    return task2;
+  }
+
 void
-do_store_role_record_into_redis(::poseidon::Abstract_Fiber& fiber, Role_Record& roinfo, seconds ttl)
+do_store_role_record_into_redis(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
+                                Role_Record& roinfo)
   {
+    // If the role already exists in Redis, in either layout, it is returned
+    // and nothing is written.
+    static constexpr char redis_store_role_if_absent[] =
+        R"!!!(
+          local kind = redis.call('TYPE', KEYS[1]).ok
+          if kind == 'hash' then
+            return redis.call('HMGET', KEYS[1], 'meta', 'avatar', 'profile', 'whole')
+          elseif kind ~= 'none' then
+            return redis.call('GET', KEYS[1])
+          elseif ARGV[2] == 'hash' then
+            redis.call('HSET', KEYS[1], 'meta', ARGV[3], 'avatar', ARGV[4],
+                       'profile', ARGV[5], 'whole', ARGV[6])
+            redis.call('EXPIRE', KEYS[1], ARGV[1])
+          else
+            redis.call('SET', KEYS[1], ARGV[3], 'EX', ARGV[1])
+          end
+          return false
+        )!!!";
+
     cow_vector<cow_string> redis_cmd;
-    redis_cmd.emplace_back(&"SET");
-    redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roinfo.roid));
-    redis_cmd.emplace_back(roinfo.serialize_to_string());
-    redis_cmd.emplace_back(&"NX");  // no replace
-    redis_cmd.emplace_back(&"GET");
-    redis_cmd.emplace_back(&"EX");
-    redis_cmd.emplace_back(sformat("$1", ttl.count()));
+    redis_cmd.emplace_back(&"EVAL");
+    redis_cmd.emplace_back(&redis_store_role_if_absent);
+    redis_cmd.emplace_back(&"1");   // one key
+    redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roinfo.roid));  // KEYS[1]
+    redis_cmd.emplace_back(sformat("$1", impl->redis_role_ttl.count()));  // ARGV[1]
+
+    if(impl->redis_role_hash) {
+      redis_cmd.emplace_back(&"hash");  // ARGV[2]
+      redis_cmd.emplace_back(roinfo.serialize_meta_to_string());  // ARGV[3]
+      redis_cmd.emplace_back(roinfo.avatar);  // ARGV[4]
+      redis_cmd.emplace_back(roinfo.profile);  // ARGV[5]
+      redis_cmd.emplace_back(roinfo.whole);  // ARGV[6]
+    }
+    else {
+      redis_cmd.emplace_back(&"string");  // ARGV[2]
+      redis_cmd.emplace_back(roinfo.serialize_to_string());  // ARGV[3]
+    }
 
     auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
     ::poseidon::task_scheduler.launch(task2);
     fiber.yield(task2);
 
     if(!task2->result().is_nil())
-      roinfo.parse_from_string(task2->result().as_string());
+      roinfo.parse_from_redis_value(task2->result());
 
     POSEIDON_LOG_INFO(("Loaded from MySQL: role `$1` (`$2`), updated on `$3`"),
                       roinfo.roid, roinfo.nickname, roinfo.update_time);
@@ -154,26 +318,24 @@ do_star_role_list(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber&
     for(const auto& row : task1->result_rows()) {
       Role_Record roinfo;
       roinfo.roid = row.at(0).as_integer();      // SELECT `roid`
-      roinfo.avatar = row.at(1).as_blob();       //        , `avatar`
+      roinfo.avatar = blob_decompress(row.at(1).as_blob());       //        , `avatar`
       db_records.emplace_back(move(roinfo));
     }
 
     POSEIDON_LOG_INFO(("Found $1 role(s) for user `$2`"), db_records.size(), username);
 
     if(db_records.size() > 0) {
-      // See whether Redis contains unflushed role records.
-      cow_vector<cow_string> redis_cmd;
-      redis_cmd.emplace_back(&"MGET");
-      for(size_t k = 0;  k < db_records.size();  ++k)
-        redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), db_records.at(k).roid));
+      // See whether Redis contains unflushed role records. Only avatars are
+      // required, so `profile` and `whole` of hashes are not fetched.
+      ::std::vector<int64_t> roids;
+      for(const auto& roinfo : db_records)
+        roids.push_back(roinfo.roid);
 
-      auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
-      ::poseidon::task_scheduler.launch(task2);
-      fiber.yield(task2);
+      auto task2 = do_fetch_role_records_from_redis(fiber, roids.data(), roids.size(), true);
 
       for(size_t k = 0;  k < db_records.size();  ++k)
         if(!task2->result().as_array().at(k).is_nil())
-          db_records.at(k).parse_from_string(task2->result().as_array().at(k).as_string());
+          db_records.at(k).parse_from_redis_value(task2->result().as_array().at(k));
     }
 
     // Encode avatars in an object, and return it.
@@ -227,7 +389,7 @@ do_star_role_create(const shptr<Implementation>& impl, ::poseidon::Abstract_Fibe
     sql_args.emplace_back(roinfo.roid);               // SET `roid` = ?
     sql_args.emplace_back(roinfo.username.rdstr());   //     , `username` = ?
     sql_args.emplace_back(roinfo.nickname);           //     , `nickname` = ?
-    sql_args.emplace_back(roinfo.update_time);        //     , `update_time` = ?
+    sql_args.emplace_back(do_mysql_update_time(roinfo));   //     , `update_time` = ?
 
     auto task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
                                                move(mysql_conn), &insert_into_role, sql_args);
@@ -265,12 +427,13 @@ do_star_role_create(const shptr<Implementation>& impl, ::poseidon::Abstract_Fibe
 
       roinfo.nickname = task1->result_row(0).at(0).as_blob();            // SELECT `nickname`
       roinfo.update_time = task1->result_row(0).at(1).as_system_time();  //        , `update_time`
-      roinfo.avatar = task1->result_row(0).at(2).as_blob();              //        , `avatar`
-      roinfo.profile = task1->result_row(0).at(3).as_blob();             //        , `profile`
-      roinfo.whole = task1->result_row(0).at(4).as_blob();               //        , `whole`
+      roinfo.avatar = blob_decompress(task1->result_row(0).at(2).as_blob());    //        , `avatar`
+      roinfo.profile = blob_decompress(task1->result_row(0).at(3).as_blob());   //        , `profile`
+      roinfo.whole = blob_decompress(task1->result_row(0).at(4).as_blob());     //        , `whole`
     }
 
-    do_store_role_record_into_redis(fiber, roinfo, impl->redis_role_ttl);
+    impl->stored_digests.insert_or_assign(roinfo.roid, do_digest_role_record(roinfo));
+    do_store_role_record_into_redis(impl, fiber, roinfo);
     impl->role_records.insert_or_assign(roinfo.roid, roinfo);
 
     POSEIDON_LOG_INFO(("Created role `$1` (`$2`)"), roinfo.roid, roinfo.nickname);
@@ -326,11 +489,12 @@ do_star_role_load(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber&
     roinfo.username = task1->result_row(0).at(0).as_blob();            // SELECT `username`
     roinfo.nickname = task1->result_row(0).at(1).as_blob();            //        , `nickname`
     roinfo.update_time = task1->result_row(0).at(2).as_system_time();  //        , `update_time`
-    roinfo.avatar = task1->result_row(0).at(3).as_blob();              //        , `avatar`
-    roinfo.profile = task1->result_row(0).at(4).as_blob();             //        , `profile`
-    roinfo.whole = task1->result_row(0).at(5).as_blob();               //        , `whole`
+    roinfo.avatar = blob_decompress(task1->result_row(0).at(3).as_blob());    //        , `avatar`
+    roinfo.profile = blob_decompress(task1->result_row(0).at(4).as_blob());   //        , `profile`
+    roinfo.whole = blob_decompress(task1->result_row(0).at(5).as_blob());     //        , `whole`
 
-    do_store_role_record_into_redis(fiber, roinfo, impl->redis_role_ttl);
+    impl->stored_digests.insert_or_assign(roinfo.roid, do_digest_role_record(roinfo));
+    do_store_role_record_into_redis(impl, fiber, roinfo);
     impl->role_records.insert_or_assign(roinfo.roid, roinfo);
 
     POSEIDON_LOG_INFO(("Loaded role `$1` (`$2`)"), roinfo.roid, roinfo.nickname);
@@ -339,10 +503,19 @@ do_star_role_load(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber&
   }
 
 void
-do_store_role_record_into_mysql(::poseidon::Abstract_Fiber& fiber,
+do_store_role_record_into_mysql(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
                                 uniptr<::poseidon::MySQL_Connection>&& mysql_conn_opt,
                                 Role_Record& roinfo)
   {
+    uint64_t digest = do_digest_role_record(roinfo);
+    uint64_t stored_digest;
+    if(impl->stored_digests.find_and_copy(stored_digest, roinfo.roid) && (stored_digest == digest)) {
+      POSEIDON_LOG_DEBUG(("#sav# Role `$1` (`$2`) unchanged; skipped"), roinfo.roid, roinfo.nickname);
+      if(mysql_conn_opt)
+        ::poseidon::mysql_connector.pool_connection(move(mysql_conn_opt));
+      return;
+    }
+
     POSEIDON_LOG_INFO(("#sav# Storing into MySQL: role `$1` (`$2`), updated on `$3`"),
                       roinfo.roid, roinfo.nickname, roinfo.update_time);
 
@@ -361,10 +534,10 @@ do_store_role_record_into_mysql(::poseidon::Abstract_Fiber& fiber,
     cow_vector<::poseidon::MySQL_Value> sql_args;
     sql_args.emplace_back(roinfo.username.rdstr());   // SET `username` = ?
     sql_args.emplace_back(roinfo.nickname);           //     , `nickname` = ?
-    sql_args.emplace_back(roinfo.update_time);        //     , `update_time` = ?
-    sql_args.emplace_back(roinfo.avatar);             //     , `avatar` = ?
-    sql_args.emplace_back(roinfo.profile);            //     , `profile` = ?
-    sql_args.emplace_back(roinfo.whole);              //     , `whole` = ?
+    sql_args.emplace_back(do_mysql_update_time(roinfo));   //     , `update_time` = ?
+    sql_args.emplace_back(blob_compress(roinfo.avatar, impl->blob_codec));    //     , `avatar` = ?
+    sql_args.emplace_back(blob_compress(roinfo.profile, impl->blob_codec));   //     , `profile` = ?
+    sql_args.emplace_back(blob_compress(roinfo.whole, impl->blob_codec));     //     , `whole` = ?
     sql_args.emplace_back(roinfo.roid);               // WHERE `roid` = ?
 
     auto task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
@@ -372,10 +545,151 @@ do_store_role_record_into_mysql(::poseidon::Abstract_Fiber& fiber,
     ::poseidon::task_scheduler.launch(task1);
     fiber.yield(task1);
 
+    // If the statement has failed, this throws an exception, and the digest
+    // is not recorded. Log statements may not evaluate their arguments, so
+    // this is done outside.
+    auto matched = task1->match_count();
+    POSEIDON_LOG_TRACE(("#sav# $1 row(s) matched"), matched);
+    do_mark_role_record_stored(impl, roinfo.roid, digest);
+
     POSEIDON_LOG_INFO(("#sav# Stored into MySQL: role `$1` (`$2`), updated on `$3`"),
                       roinfo.roid, roinfo.nickname, roinfo.update_time);
   }
 
+void
+do_make_store_roles_statement(cow_string& stmt, cow_vector<::poseidon::MySQL_Value>& sql_args,
+                              const Role_Record* roles, size_t count, Blob_Codec codec)
+  {
+    // Write all roles with a single statement:
+    //   UPDATE `role`
+    //     SET `username` = CASE `roid` WHEN ? THEN ? ... END
+    //         , ...
+    //     WHERE `roid` IN (?, ...)
+    // A row that has been deleted is not created again.
+    static constexpr const char* columns[] =
+        { "username", "nickname", "update_time", "avatar", "profile", "whole" };
+
+    stmt = &"UPDATE `role` SET";
+    sql_args.clear();
+    for(size_t c = 0;  c != 6;  ++c) {
+      stmt += (c == 0) ? " `" : ", `";
+      stmt += columns[c];
+      stmt += "` = CASE `roid`";
+      for(size_t k = 0;  k != count;  ++k) {
+        const Role_Record& roinfo = roles[k];
+        stmt += " WHEN ? THEN ?";
+        sql_args.emplace_back(roinfo.roid);
+        switch(c) {
+          case 0: sql_args.emplace_back(roinfo.username.rdstr());  break;
+          case 1: sql_args.emplace_back(roinfo.nickname);  break;
+          case 2: sql_args.emplace_back(do_mysql_update_time(roinfo));  break;
+          case 3: sql_args.emplace_back(blob_compress(roinfo.avatar, codec));  break;
+          case 4: sql_args.emplace_back(blob_compress(roinfo.profile, codec));  break;
+          default: sql_args.emplace_back(blob_compress(roinfo.whole, codec));  break;
+        }
+      }
+      stmt += " END";
+    }
+
+    stmt += " WHERE `roid` IN (";
+    for(size_t k = 0;  k != count;  ++k) {
+      stmt += "?,";
+      sql_args.emplace_back(roles[k].roid);
+    }
+
+    stmt.mut_back() = ')';
+  }
+
+void
+do_store_role_records_into_mysql(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
+                                 ::std::vector<Role_Record>& roles)
+  {
+    // Drop roles that haven't changed since they were last written.
+    ::std::vector<uint64_t> digests;
+    size_t count = 0;
+    for(size_t k = 0;  k != roles.size();  ++k) {
+      uint64_t digest = do_digest_role_record(roles[k]);
+      uint64_t stored_digest;
+      if(impl->stored_digests.find_and_copy(stored_digest, roles[k].roid) && (stored_digest == digest))
+        continue;
+
+      if(count != k)
+        roles[count] = move(roles[k]);
+      digests.push_back(digest);
+      count ++;
+    }
+
+    roles.erase(roles.begin() + static_cast<ptrdiff_t>(count), roles.end());
+    if(roles.empty())
+      return;
+
+    POSEIDON_LOG_INFO(("#sav# Storing into MySQL: $1 role(s)"), roles.size());
+
+    // Split roles into batches, and write up to `save_concurrency` batches at
+    // a time. Each statement runs on its own pooled connection.
+    const size_t batch_size = impl->save_batch_size;
+    const size_t concurrency = impl->save_concurrency;
+    size_t offset = 0;
+    size_t failed = 0;
+    while(offset != roles.size()) {
+      cow_vector<shptr<::poseidon::MySQL_Query_Future>> tasks;
+      cow_vector<shptr<::poseidon::Abstract_Future>> futures;
+      ::std::vector<size_t> offsets;
+      while((offset != roles.size()) && (tasks.size() < concurrency)) {
+        size_t n = ::std::min(roles.size() - offset, batch_size);
+        cow_string stmt;
+        cow_vector<::poseidon::MySQL_Value> sql_args;
+        do_make_store_roles_statement(stmt, sql_args, roles.data() + offset, n, impl->blob_codec);
+
+        auto task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector, stmt, sql_args);
+        ::poseidon::task_scheduler.launch(task1);
+        tasks.emplace_back(task1);
+        futures.emplace_back(task1);
+        offsets.push_back(offset);
+        offset += n;
+      }
+
+      when_all(fiber, futures);
+
+      for(size_t t = 0;  t != tasks.size();  ++t) {
+        size_t begin = offsets[t];
+        size_t end = (t + 1 != tasks.size()) ? offsets[t + 1] : offset;
+        try {
+          // If the statement has failed, this throws an exception. Log
+          // statements may not evaluate their arguments, so this is done
+          // outside.
+          auto matched = tasks[t]->match_count();
+          POSEIDON_LOG_DEBUG(("#sav# $1 row(s) matched"), matched);
+        }
+        catch(exception& stdex) {
+          // Find out which roles can't be written, by writing them one by one.
+          POSEIDON_LOG_ERROR(("#sav# Could not store $1 role(s) into MySQL: $2"), end - begin, stdex);
+
+          for(size_t k = begin;  k != end;  ++k)
+            try {
+              do_store_role_record_into_mysql(impl, fiber, nullptr, roles[k]);
+            }
+            catch(exception& stdex2) {
+              POSEIDON_LOG_ERROR(("#sav# Could not store role `$1` (`$2`) into MySQL: $3"),
+                                 roles[k].roid, roles[k].nickname, stdex2);
+              failed ++;
+            }
+          continue;
+        }
+
+        for(size_t k = begin;  k != end;  ++k)
+          do_mark_role_record_stored(impl, roles[k].roid, digests[k]);
+      }
+    }
+
+    // Roles that have failed are not marked stored, so they will be written
+    // again in the next cycle.
+    if(failed != 0)
+      POSEIDON_THROW(("Could not store $1 of $2 role(s) into MySQL"), failed, roles.size());
+
+    POSEIDON_LOG_INFO(("#sav# Stored into MySQL: $1 role(s)"), roles.size());
+  }
+
 void
 do_star_role_unload(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
                     const ::poseidon::UUID& /*request_service_uuid*/,
@@ -388,16 +702,11 @@ do_star_role_unload(const shptr<Implementation>& impl, ::poseidon::Abstract_Fibe
     //
     POSEIDON_CHECK(impl->db_ready);
 
-    cow_vector<cow_string> redis_cmd;
-    redis_cmd.emplace_back(&"GET");
-    redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roid));
-
-    auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
-    ::poseidon::task_scheduler.launch(task2);
-    fiber.yield(task2);
+    auto task2 = do_fetch_role_records_from_redis(fiber, &roid, 1, false);
+    const ::poseidon::Redis_Value* value = &(task2->result().as_array().at(0));
 
-    if(task2->result().is_nil()) {
-      impl->role_records.erase(roid);
+    if(value->is_nil()) {
+      do_forget_role_record(impl, roid);
       response.try_emplace(&"status", &"gs_role_not_loaded");
       return;
     }
@@ -407,7 +716,7 @@ do_star_role_unload(const shptr<Implementation>& impl, ::poseidon::Abstract_Fibe
     // the value on Redis is unchanged before deleting it safely.
     Role_Record roinfo;
     do {
-      roinfo.parse_from_string(task2->result().as_string());
+      roinfo.parse_from_redis_value(*value);
 
       auto mysql_conn = ::poseidon::mysql_connector.allocate_default_connection();
       if((roinfo._home_host != ::poseidon::hostname) || (roinfo._home_db != mysql_conn->service_uri())) {
@@ -416,32 +725,40 @@ do_star_role_unload(const shptr<Implementation>& impl, ::poseidon::Abstract_Fibe
         return;
       }
 
-      do_store_role_record_into_mysql(fiber, move(mysql_conn), roinfo);
+      do_store_role_record_into_mysql(impl, fiber, move(mysql_conn), roinfo);
 
       static constexpr char redis_delete_if_unchanged[] =
           R"!!!(
-            local value = redis.call('GET', KEYS[1])
-            if value == ARGV[1] then
+            local value, version
+            if redis.call('TYPE', KEYS[1]).ok == 'hash' then
+              value = redis.call('HMGET', KEYS[1], 'meta', 'avatar', 'profile', 'whole')
+              version = value[1]
+            else
+              value = redis.call('GET', KEYS[1])
+              version = value
+            end
+            if version == ARGV[1] then
               redis.call('DEL', KEYS[1])
-              return nil
+              return false
             else
               return value
             end
           )!!!";
 
-      redis_cmd.clear();
+      cow_vector<cow_string> redis_cmd;
       redis_cmd.emplace_back(&"EVAL");
       redis_cmd.emplace_back(&redis_delete_if_unchanged);
       redis_cmd.emplace_back(&"1");   // one key
       redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roinfo.roid));  // KEYS[1]
-      redis_cmd.emplace_back(task2->result().as_string());  // ARGV[1]
+      redis_cmd.emplace_back(do_get_role_version_from_redis(*value));  // ARGV[1]
 
       task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
       ::poseidon::task_scheduler.launch(task2);
       fiber.yield(task2);
+      value = &(task2->result());
     }
-    while(!task2->result().is_nil());
-    impl->role_records.erase(roid);
+    while(!value->is_nil());
+    do_forget_role_record(impl, roid);
 
     POSEIDON_LOG_INFO(("Unloaded role `$1` (`$2`)"), roinfo.roid, roinfo.nickname);
 
@@ -462,23 +779,18 @@ do_star_role_flush(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber
 
     POSEIDON_LOG_INFO(("#sav# Flushing role `$1`"), roid);
 
-    cow_vector<cow_string> redis_cmd;
-    redis_cmd.emplace_back(&"GET");
-    redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roid));
-
-    auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
-    ::poseidon::task_scheduler.launch(task2);
-    fiber.yield(task2);
+    auto task2 = do_fetch_role_records_from_redis(fiber, &roid, 1, false);
+    const auto& value = task2->result().as_array().at(0);
 
-    if(task2->result().is_nil()) {
-      impl->role_records.erase(roid);
+    if(value.is_nil()) {
+      do_forget_role_record(impl, roid);
       response.try_emplace(&"status", &"gs_role_not_loaded");
       return;
     }
 
     // Write a snapshot of role information to MySQL.
     Role_Record roinfo;
-    roinfo.parse_from_string(task2->result().as_string());
+    roinfo.parse_from_redis_value(value);
 
     auto mysql_conn = ::poseidon::mysql_connector.allocate_default_connection();
     if((roinfo._home_host != ::poseidon::hostname) || (roinfo._home_db != mysql_conn->service_uri())) {
@@ -488,7 +800,7 @@ do_star_role_flush(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber
     }
 
     impl->role_records.insert_or_assign(roinfo.roid, roinfo);
-    do_store_role_record_into_mysql(fiber, move(mysql_conn), roinfo);
+    do_store_role_record_into_mysql(impl, fiber, move(mysql_conn), roinfo);
 
     POSEIDON_LOG_INFO(("Flushed role `$1` (`$2`)"), roinfo.roid, roinfo.nickname);
 
@@ -496,58 +808,603 @@ do_star_role_flush(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber
   }
 
 void
-do_save_timer_callback(const shptr<Implementation>& impl,
-                       const shptr<::poseidon::Abstract_Timer>& /*timer*/,
-                       ::poseidon::Abstract_Fiber& fiber, steady_time /*now*/)
+do_put_journal_record(cow_string& data, const Role_Record& roinfo)
   {
-    if(impl->db_ready == false) {
-      // Check tables.
-      do_mysql_check_table_role(fiber);
-      impl->db_ready = true;
+    // Each record is a 32-bit length, a CRC-32 of the payload, and the payload,
+    // which is a serialized role. Integers are little-endian. A record that is
+    // torn by a crash fails the check, and is discarded with all that follow.
+    cow_string str = roinfo.serialize_to_string();
+    POSEIDON_CHECK(str.size() <= UINT32_MAX);
+    uint32_t crc = static_cast<uint32_t>(::crc32(0, reinterpret_cast<const ::Bytef*>(str.data()),
+                                                 static_cast<::uInt>(str.size())));
+
+    for(uint32_t word : { static_cast<uint32_t>(str.size()), crc })
+      for(uint32_t k = 0;  k != 4;  ++k)
+        data.push_back(static_cast<char>(word >> k * 8));
+
+    data.append(str);
+  }
+
+void
+do_write_journal(int fd, const cow_string& data)
+  {
+    size_t offset = 0;
+    while(offset != data.size()) {
+      ::ssize_t r = ::write(fd, data.data() + offset, data.size() - offset);
+      if(r < 0) {
+        if(errno == EINTR)
+          continue;
+
+        POSEIDON_THROW((
+            "Could not write journal",
+            "[`write()` failed: ${errno:full}]"));
+      }
+      offset += static_cast<size_t>(r);
+    }
+
+    // Records are written in batches, so this is paid once per batch.
+    if(::fdatasync(fd) != 0)
+      POSEIDON_THROW((
+          "Could not synchronize journal",
+          "[`fdatasync()` failed: ${errno:full}]"));
+  }
+
+void
+do_open_journal(const shptr<Implementation>& impl)
+  {
+    impl->journal_fd.reset(::open(impl->journal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644));
+    if(!impl->journal_fd)
+      POSEIDON_THROW((
+          "Could not open journal `$1`",
+          "[`open()` failed: ${errno:full}]"),
+          impl->journal_path);
+
+    struct ::stat st;
+    if(::fstat(impl->journal_fd.get(), &st) != 0)
+      POSEIDON_THROW((
+          "Could not get size of journal `$1`",
+          "[`fstat()` failed: ${errno:full}]"),
+          impl->journal_path);
+
+    impl->journal_size = static_cast<size_t>(st.st_size);
+  }
+
+struct Journal_Append_Future final : ::poseidon::Abstract_Future, ::poseidon::Abstract_Task
+  {
+    ::rocket::unique_posix_fd m_fd;
+    cow_string m_data;
+
+    Journal_Append_Future(int fd, const cow_string& data)
+      :
+        m_fd(::fcntl(fd, F_DUPFD_CLOEXEC, 0)), m_data(data)
+      {
+        // The journal may be reopened while this task is pending, so it
+        // writes through a descriptor of its own.
+        if(!this->m_fd)
+          POSEIDON_THROW((
+              "Could not duplicate journal descriptor",
+              "[`fcntl()` failed: ${errno:full}]"));
+      }
+
+    virtual
+    void
+    do_on_abstract_task_execute() override
+      {
+        this->do_abstract_future_initialize_once();
+      }
+
+    virtual
+    void
+    do_on_abstract_future_initialize() override
+      {
+        do_write_journal(this->m_fd.get(), this->m_data);
+      }
+
+    // This throws an exception if the journal could not be written.
+    size_t
+    size() const
+      {
+        this->check_success();
+        return this->m_data.size();
+      }
+  };
+
+void
+do_append_roles_to_journal(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
+                           const ::std::vector<Role_Record>& roles)
+  {
+    // Roles that are unchanged since they were last journaled or written to
+    // MySQL are not journaled again.
+    cow_string data;
+    ::std::vector<::std::pair<int64_t, uint64_t>> digests;
+    for(const auto& roinfo : roles) {
+      uint64_t digest = do_digest_role_record(roinfo);
+      uint64_t old_digest;
+      if(impl->journaled_digests.find_and_copy(old_digest, roinfo.roid) && (old_digest == digest))
+        continue;
+      if(impl->stored_digests.find_and_copy(old_digest, roinfo.roid) && (old_digest == digest))
+        continue;
+
+      do_put_journal_record(data, roinfo);
+      digests.emplace_back(roinfo.roid, digest);
     }
 
-    if(impl->save_buckets.empty()) {
-      // Arrange online roles for writing. Initially, users are divided into 20
-      // buckets. For each timer tick, one bucket will be popped and written.
-      while(impl->save_buckets.size() < 20)
-        impl->save_buckets.emplace_back();
+    if(data.empty())
+      return;
+
+    // Records are taken as journaled only after they have been synchronized.
+    auto task3 = new_sh<Journal_Append_Future>(impl->journal_fd.get(), data);
+    ::poseidon::task_scheduler.launch(task3);
+    fiber.yield(task3);
+    impl->journal_size += task3->size();
 
-      for(const auto& r : impl->role_records) {
-        auto first_bucket = impl->save_buckets.begin();
-        if(first_bucket->size() >= first_bucket->capacity())
-          first_bucket = impl->save_buckets.emplace(first_bucket);
+    for(const auto& r : digests)
+      impl->journaled_digests.insert_or_assign(r.first, r.second);
+
+    POSEIDON_LOG_DEBUG(("#sav# Journaled $1 role(s), $2 byte(s)"), digests.size(), data.size());
+  }
 
-        first_bucket->push_back(r.first);
-        impl->save_buckets.splice(impl->save_buckets.end(), impl->save_buckets, first_bucket);
+void
+do_sync_directory(const cow_string& path)
+  {
+    // A rename is durable only after its directory has been synchronized.
+    ::rocket::unique_posix_fd fd(::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if(!fd)
+      POSEIDON_THROW((
+          "Could not open directory `$1`",
+          "[`open()` failed: ${errno:full}]"),
+          path);
+
+    if(::fsync(fd.get()) != 0)
+      POSEIDON_THROW((
+          "Could not synchronize directory `$1`",
+          "[`fsync()` failed: ${errno:full}]"),
+          path);
+  }
+
+// Reading and compacting a journal may take a while, so these are done by
+// tasks, away from the fiber thread.
+struct Journal_Read_Future final : ::poseidon::Abstract_Future, ::poseidon::Abstract_Task
+  {
+    cow_string m_path;
+    cow_int64_dictionary<Role_Record> m_latest;
+    size_t m_size = 0;
+    size_t m_valid_size = 0;
+
+    explicit
+    Journal_Read_Future(const cow_string& path)
+      :
+        m_path(path)
+      {
+      }
+
+    virtual
+    void
+    do_on_abstract_task_execute() override
+      {
+        this->do_abstract_future_initialize_once();
+      }
+
+    virtual
+    void
+    do_on_abstract_future_initialize() override
+      {
+        ::rocket::unique_posix_fd fd(::open(this->m_path.c_str(), O_RDONLY | O_CLOEXEC));
+        if(!fd) {
+          if(errno == ENOENT)
+            return;
+
+          POSEIDON_THROW((
+              "Could not open journal `$1`",
+              "[`open()` failed: ${errno:full}]"),
+              this->m_path);
+        }
+
+        cow_string data;
+        for(;;) {
+          size_t old_size = data.size();
+          data.append(0x10000, '\0');
+          ::ssize_t r = ::read(fd.get(), data.mut_data() + old_size, 0x10000);
+          if(r < 0) {
+            data.erase(old_size);
+            if(errno == EINTR)
+              continue;
+
+            POSEIDON_THROW((
+                "Could not read journal `$1`",
+                "[`read()` failed: ${errno:full}]"),
+                this->m_path);
+          }
+
+          data.erase(old_size + static_cast<size_t>(r));
+          if(r == 0)
+            break;
+        }
+
+        // Only the last snapshot of each role matters.
+        size_t offset = 0;
+        while(data.size() - offset >= 8) {
+          uint32_t words[2] = { };
+          for(size_t w = 0;  w != 2;  ++w)
+            for(uint32_t k = 0;  k != 4;  ++k)
+              words[w] |= static_cast<uint32_t>(static_cast<unsigned char>(data[offset + w * 4 + k])) << k * 8;
+
+          if(data.size() - offset - 8 < words[0])
+            break;
+
+          uint32_t crc = static_cast<uint32_t>(::crc32(0, reinterpret_cast<const ::Bytef*>(data.data() + offset + 8),
+                                                       static_cast<::uInt>(words[0])));
+          if(crc != words[1])
+            break;
+
+          Role_Record roinfo;
+          roinfo.parse_from_string(cow_string(data, offset + 8, words[0]));
+          this->m_latest.insert_or_assign(roinfo.roid, move(roinfo));
+          offset += 8 + words[0];
+        }
+
+        this->m_size = data.size();
+        this->m_valid_size = offset;
+      }
+
+    // These throw an exception if the journal could not be read.
+    const cow_int64_dictionary<Role_Record>&
+    latest() const
+      {
+        this->check_success();
+        return this->m_latest;
+      }
+
+    size_t
+    torn_offset() const
+      {
+        this->check_success();
+        return (this->m_valid_size != this->m_size) ? this->m_valid_size : SIZE_MAX;
+      }
+  };
+
+struct Journal_Compact_Future final : ::poseidon::Abstract_Future, ::poseidon::Abstract_Task
+  {
+    cow_string m_directory;
+    cow_string m_path;
+    cow_int64_dictionary<Role_Record> m_role_records;
+    cow_int64_dictionary<uint64_t> m_stored_digests;
+    size_t m_size = 0;
+    size_t m_count = 0;
+
+    Journal_Compact_Future(const cow_string& directory, const cow_string& path,
+                           const cow_int64_dictionary<Role_Record>& role_records,
+                           const cow_int64_dictionary<uint64_t>& stored_digests)
+      :
+        m_directory(directory), m_path(path), m_role_records(role_records),
+        m_stored_digests(stored_digests)
+      {
       }
+
+    virtual
+    void
+    do_on_abstract_task_execute() override
+      {
+        this->do_abstract_future_initialize_once();
+      }
+
+    virtual
+    void
+    do_on_abstract_future_initialize() override
+      {
+        // Keep only roles that have changed since they were last written to
+        // MySQL. The new journal is written aside, then renamed over the old
+        // one.
+        cow_string data;
+        for(const auto& r : this->m_role_records) {
+          uint64_t stored_digest;
+          if(this->m_stored_digests.find_and_copy(stored_digest, r.first)
+             && (stored_digest == do_digest_role_record(r.second)))
+            continue;
+
+          do_put_journal_record(data, r.second);
+          this->m_count ++;
+        }
+
+        cow_string temp_path = this->m_path + ".tmp";
+        ::rocket::unique_posix_fd fd(::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        if(!fd)
+          POSEIDON_THROW((
+              "Could not open journal `$1`",
+              "[`open()` failed: ${errno:full}]"),
+              temp_path);
+
+        do_write_journal(fd.get(), data);
+
+        if(::rename(temp_path.c_str(), this->m_path.c_str()) != 0)
+          POSEIDON_THROW((
+              "Could not rename journal `$1` to `$2`",
+              "[`rename()` failed: ${errno:full}]"),
+              temp_path, this->m_path);
+
+        do_sync_directory(this->m_directory);
+        this->m_size = data.size();
+      }
+
+    // These throw an exception if the journal could not be compacted.
+    size_t
+    size() const
+      {
+        this->check_success();
+        return this->m_size;
+      }
+
+    size_t
+    count() const
+      {
+        this->check_success();
+        return this->m_count;
+      }
+  };
+
+void
+do_replay_journal(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber)
+  {
+    auto task3 = new_sh<Journal_Read_Future>(impl->journal_path);
+    ::poseidon::task_scheduler.launch(task3);
+    fiber.yield(task3);
+
+    if(task3->torn_offset() != SIZE_MAX)
+      POSEIDON_LOG_WARN(("Journal `$1` is torn at offset $2; the rest is discarded"),
+                        impl->journal_path, task3->torn_offset());
+
+    POSEIDON_LOG_INFO(("#sav# Replaying journal `$1`: $2 role(s)"),
+                      impl->journal_path, task3->latest().size());
+
+    // A snapshot is written only if it's newer than the one in MySQL, which
+    // may have been written after it was journaled. As `update_time` holds
+    // whole seconds, times are compared at that precision; a snapshot in the
+    // same second as the one in MySQL is not written, so a newer one can't be
+    // overwritten by an older one.
+    static constexpr char update_role_if_older[] =
+        R"!!!(
+          UPDATE `role`
+            SET `username` = ?
+                , `nickname` = ?
+                , `update_time` = ?
+                , `avatar` = ?
+                , `profile` = ?
+                , `whole` = ?
+            WHERE `roid` = ?
+                  AND `update_time` < ?
+        )!!!";
+
+    size_t count = 0;
+    for(const auto& r : task3->latest()) {
+      const Role_Record& roinfo = r.second;
+
+      cow_vector<::poseidon::MySQL_Value> sql_args;
+      sql_args.emplace_back(roinfo.username.rdstr());   // SET `username` = ?
+      sql_args.emplace_back(roinfo.nickname);           //     , `nickname` = ?
+      sql_args.emplace_back(do_mysql_update_time(roinfo));   //     , `update_time` = ?
+      sql_args.emplace_back(blob_compress(roinfo.avatar, impl->blob_codec));    //     , `avatar` = ?
+      sql_args.emplace_back(blob_compress(roinfo.profile, impl->blob_codec));   //     , `profile` = ?
+      sql_args.emplace_back(blob_compress(roinfo.whole, impl->blob_codec));     //     , `whole` = ?
+      sql_args.emplace_back(roinfo.roid);               // WHERE `roid` = ?
+      sql_args.emplace_back(do_mysql_update_time(roinfo));   //       AND `update_time` < ?
+
+      auto task1 = new_sh<::poseidon::MySQL_Query_Future>(::poseidon::mysql_connector,
+                                                          &update_role_if_older, sql_args);
+      ::poseidon::task_scheduler.launch(task1);
+      fiber.yield(task1);
+      count += static_cast<size_t>(task1->match_count());
     }
 
-    auto bucket = move(impl->save_buckets.back());
-    impl->save_buckets.pop_back();
-    while(!bucket.empty()) {
-      int64_t roid = bucket.back();
-      bucket.pop_back();
+    POSEIDON_LOG_INFO(("#sav# Replayed journal `$1`: $2 role(s) recovered"), impl->journal_path, count);
+  }
 
-      cow_vector<cow_string> redis_cmd;
-      redis_cmd.emplace_back(&"GET");
-      redis_cmd.emplace_back(sformat("$1/role/$2", service.application_name(), roid));
+void
+do_compact_journal(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber)
+  {
+    // Role records are copy-on-write, so the task gets a snapshot of them.
+    auto task3 = new_sh<Journal_Compact_Future>(impl->journal_directory, impl->journal_path,
+                                                impl->role_records, impl->stored_digests);
+    ::poseidon::task_scheduler.launch(task3);
+    fiber.yield(task3);
 
-      auto task2 = new_sh<::poseidon::Redis_Query_Future>(::poseidon::redis_connector, redis_cmd);
-      ::poseidon::task_scheduler.launch(task2);
-      fiber.yield(task2);
+    POSEIDON_LOG_INFO(("#sav# Compacted journal `$1`: $2 => $3 byte(s), $4 role(s)"),
+                      impl->journal_path, impl->journal_size, task3->size(), task3->count());
+
+    do_open_journal(impl);
+    impl->journal_compact_size = ::std::max(journal_min_compact_size, task3->size() * 4);
+  }
+
+void
+do_forget_stored_roles(const shptr<Implementation>& impl, const ::std::vector<int64_t>& roids)
+  {
+    for(int64_t roid : roids) {
+      Role_Record roinfo;
+      uint64_t stored_digest;
+      if(impl->role_records.find_and_copy(roinfo, roid)
+         && impl->stored_digests.find_and_copy(stored_digest, roid)
+         && (stored_digest == do_digest_role_record(roinfo)))
+        do_forget_role_record(impl, roid);
+    }
+  }
 
-      if(task2->result().is_nil()) {
-        impl->role_records.erase(roid);
+void
+do_save_role_bucket(const shptr<Implementation>& impl, ::poseidon::Abstract_Fiber& fiber,
+                    const static_vector<int64_t, 255>& bucket)
+  {
+    // Fetch all roles in this bucket with a single command, so Redis latency
+    // is paid once per bucket.
+    auto task2 = do_fetch_role_records_from_redis(fiber, bucket.data(), bucket.size(), false);
+
+    ::std::vector<Role_Record> roles;
+    ::std::vector<Role_Record> lost_roles;
+    ::std::vector<int64_t> lost_roids;
+    for(size_t k = 0;  k < bucket.size();  ++k) {
+      int64_t roid = bucket.at(k);
+      const auto& value = task2->result().as_array().at(k);
+      if(value.is_nil()) {
+        // If MySQL writes have been deferred, the last snapshot of this role
+        // may only exist in the journal. The role is kept, so compaction will
+        // not drop it, until the snapshot has been written.
+        Role_Record roinfo;
+        uint64_t stored_digest;
+        if(impl->journal_fd && impl->role_records.find_and_copy(roinfo, roid)
+           && !(impl->stored_digests.find_and_copy(stored_digest, roid)
+                && (stored_digest == do_digest_role_record(roinfo)))) {
+          lost_roles.emplace_back(move(roinfo));
+          lost_roids.push_back(roid);
+          continue;
+        }
+
+        do_forget_role_record(impl, roid);
         continue;
       }
 
-      // Write a snapshot of role information to MySQL.
+      // Write snapshots of role information to MySQL, in concurrent batches.
       Role_Record roinfo;
-      roinfo.parse_from_string(task2->result().as_string());
+      roinfo.parse_from_redis_value(value);
 
       impl->role_records.insert_or_assign(roinfo.roid, roinfo);
-      do_store_role_record_into_mysql(fiber, nullptr, roinfo);
+      roles.emplace_back(move(roinfo));
+    }
+
+    if(impl->journal_fd && !roles.empty()) {
+      // Make snapshots durable with a single `fdatasync()`. Roles that have
+      // been written to MySQL recently are left in the journal.
+      do_append_roles_to_journal(impl, fiber, roles);
+
+      // `stored_times` is updated only after a role has been written.
+      const steady_time now = steady_clock::now();
+      size_t count = 0;
+      for(size_t k = 0;  k != roles.size();  ++k) {
+        steady_time stored_time;
+        if(impl->stored_times.find_and_copy(stored_time, roles[k].roid)
+           && (now - stored_time < impl->journal_mysql_interval))
+          continue;
+
+        if(count != k)
+          roles[count] = move(roles[k]);
+        count ++;
+      }
+
+      roles.erase(roles.begin() + static_cast<ptrdiff_t>(count), roles.end());
+    }
+
+    for(auto& roinfo : lost_roles)
+      roles.emplace_back(move(roinfo));
+
+    try {
+      if(!roles.empty())
+        do_store_role_records_into_mysql(impl, fiber, roles);
+    }
+    catch(...) {
+      // Roles that failed will be retried in the next cycle.
+      do_forget_stored_roles(impl, lost_roids);
+      throw;
+    }
+
+    do_forget_stored_roles(impl, lost_roids);
+  }
+
+void
+do_save_timer_callback(const shptr<Implementation>& impl,
+                       const shptr<::poseidon::Abstract_Timer>& /*timer*/,
+                       ::poseidon::Abstract_Fiber& fiber, steady_time now)
+  {
+    if(impl->save_running)
+      return;
+
+    if(impl->db_ready == false) {
+      // Check tables. If there is a journal, recover snapshots that may not
+      // have been written to MySQL, before any request is accepted. They'll
+      // be dropped when the journal is compacted in the next cycle.
+      impl->save_running = true;
+      try {
+        do_mysql_check_table_role(fiber);
+        if(impl->journal_path != "") {
+          do_replay_journal(impl, fiber);
+          do_open_journal(impl);
+          impl->journal_compact_size = 0;
+        }
+      }
+      catch(...) {
+        impl->save_running = false;
+        throw;
+      }
+      impl->save_running = false;
+      impl->db_ready = true;
+    }
+
+    if(impl->save_queue.empty()) {
+      // Start a new cycle.
+      if(impl->journal_fd && (impl->journal_size >= impl->journal_compact_size)) {
+        impl->save_running = true;
+        try {
+          do_compact_journal(impl, fiber);
+        }
+        catch(...) {
+          impl->save_running = false;
+          throw;
+        }
+        impl->save_running = false;
+      }
+
+      for(const auto& r : impl->role_records)
+        impl->save_queue.push_back(r.first);
+
+      impl->save_deadline = now + impl->save_interval;
+      impl->save_behind_reported = false;
+      if(impl->save_queue.empty())
+        return;
+    }
+
+    // Spread remaining roles over remaining ticks evenly. If previous ticks
+    // took longer than expected, the quota grows accordingly.
+    steady_clock::duration time_left = impl->save_deadline - now;
+    size_t ticks_left = 1;
+    if(time_left > save_tick)
+      ticks_left = static_cast<size_t>(time_left / save_tick);
+
+    size_t quota = (impl->save_queue.size() + ticks_left - 1) / ticks_left;
+
+    // Check whether remaining roles can be saved in time, at the cost that
+    // has been measured so far.
+    auto time_needed = impl->save_cost_per_role * static_cast<int64_t>(impl->save_queue.size());
+    if(!impl->save_behind_reported && (time_needed > time_left)) {
+      POSEIDON_LOG_WARN((
+          "Role saving is falling behind: $1 role(s) left, $2 per role, $3 left",
+          "[consider increasing `monitor.save_interval` or `monitor.save_concurrency`]"),
+          impl->save_queue.size(), duration_cast<milliseconds>(impl->save_cost_per_role),
+          duration_cast<milliseconds>(time_left));
+      impl->save_behind_reported = true;
+    }
+
+    // If a tick overruns, subsequent ones are skipped until it finishes.
+    const steady_time start_time = steady_clock::now();
+    size_t count = 0;
+    impl->save_running = true;
+    try {
+      while((quota != 0) && !impl->save_queue.empty()) {
+        static_vector<int64_t, 255> bucket;
+        while((quota != 0) && !impl->save_queue.empty() && (bucket.size() < bucket.capacity())) {
+          bucket.push_back(impl->save_queue.front());
+          impl->save_queue.pop_front();
+          quota --;
+        }
+
+        do_save_role_bucket(impl, fiber, bucket);
+        count += bucket.size();
+      }
     }
+    catch(...) {
+      impl->save_running = false;
+      throw;
+    }
+    impl->save_running = false;
+
+    // Update the average cost of saving a role, which includes latency of both
+    // Redis and MySQL.
+    auto cost = (steady_clock::now() - start_time) / static_cast<int64_t>(count);
+    impl->save_cost_per_role = (impl->save_cost_per_role * 7 + cost) / 8;
   }
 
 }  // namespace
@@ -600,8 +1457,54 @@ reload(const ::poseidon::Config_File& conf_file)
     seconds redis_role_ttl = seconds(static_cast<int>(conf_file.get_integer_opt(
                                     &"redis_role_ttl", 600, 999999999).value_or(900)));
 
+    // `redis_role_layout`
+    cow_string redis_role_layout = conf_file.get_string_opt(&"redis_role_layout").value_or(&"string");
+    if((redis_role_layout != "string") && (redis_role_layout != "hash"))
+      POSEIDON_THROW(("Invalid `redis_role_layout` `$1`"), redis_role_layout);
+
+    // `monitor.save_interval`
+    seconds save_interval = seconds(static_cast<int>(conf_file.get_integer_opt(
+                                    &"monitor.save_interval", 10, 86400).value_or(200)));
+
+    // `monitor.save_batch_size`
+    uint16_t save_batch_size = static_cast<uint16_t>(conf_file.get_integer_opt(
+                                    &"monitor.save_batch_size", 1, 1000).value_or(50));
+
+    // `monitor.save_concurrency`
+    uint16_t save_concurrency = static_cast<uint16_t>(conf_file.get_integer_opt(
+                                    &"monitor.save_concurrency", 1, 100).value_or(4));
+
+    // `monitor.blob_compression`
+    Blob_Codec blob_codec = parse_blob_codec(conf_file.get_string_opt(
+                                    &"monitor.blob_compression").value_or(&"none"));
+
+    // `monitor.journal_directory`
+    cow_string journal_directory = conf_file.get_string_opt(&"monitor.journal_directory").value_or(&"");
+    cow_string journal_path;
+    if(journal_directory != "")
+      journal_path = sformat("$1/monitor.$2.journal", journal_directory, service.service_index());
+
+    // `monitor.journal_mysql_interval`
+    seconds journal_mysql_interval = seconds(static_cast<int>(conf_file.get_integer_opt(
+                                    &"monitor.journal_mysql_interval", 10, 86400).value_or(1800)));
+
     // Set up new configuration. This operation shall be atomic.
     this->m_impl->redis_role_ttl = redis_role_ttl;
+    this->m_impl->redis_role_hash = redis_role_layout == "hash";
+    this->m_impl->blob_codec = blob_codec;
+    this->m_impl->save_interval = save_interval;
+    this->m_impl->save_batch_size = save_batch_size;
+    this->m_impl->save_concurrency = save_concurrency;
+    this->m_impl->journal_mysql_interval = journal_mysql_interval;
+
+    if(journal_path != this->m_impl->journal_path) {
+      // The new journal will be replayed and opened by the save timer. No
+      // request is accepted until then.
+      this->m_impl->journal_directory = journal_directory;
+      this->m_impl->journal_path = journal_path;
+      this->m_impl->journal_fd.reset();
+      this->m_impl->db_ready = false;
+    }
 
     // Set up request handlers.
     service.set_handler(&"*role/list", bindw(this->m_impl, do_star_role_list));
@@ -611,7 +1514,7 @@ reload(const ::poseidon::Config_File& conf_file)
     service.set_handler(&"*role/flush", bindw(this->m_impl, do_star_role_flush));
 
     // Restart the service.
-    this->m_impl->save_timer.start(100ms, 11001ms, bindw(this->m_impl, do_save_timer_callback));
+    this->m_impl->save_timer.start(100ms, save_tick, bindw(this->m_impl, do_save_timer_callback));
   }
 
 }  // namespace k32::monitor